@@ -0,0 +1,107 @@
+/*
+ * fchar-queue: userspace access to the fchar submission/completion queues
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Copyright (C) 2015 Andrea Righi <righi.andrea@gmail.com>
+ */
+
+#ifndef FCHAR_QUEUE_H
+#define FCHAR_QUEUE_H
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "fchar.h"
+#include "fchar-ring.h"
+
+/*
+ * Usage:
+ *
+ *	struct fchar_queue_params params = {
+ *		.sq_entries = 256, .cq_entries = 512, .spin_us = 50, .cpu = -1,
+ *	};
+ *	struct fchar_queue *q = fchar_queue_map(fd, &params);
+ *	struct fchar_sqe *sqe;
+ *	struct fchar_cqe cqe;
+ *
+ *	while (!(sqe = fchar_queue_get_sqe(q)))
+ *		... reap some completions ...
+ *	sqe->opcode = FCHAR_OP_FILL;
+ *	...
+ *	fchar_queue_submit(fd, q);
+ *
+ *	while (fchar_queue_reap(q, &cqe) == 0)
+ *		... cqe.user_data, cqe.result ...
+ *
+ * There must be a single submitter and a single reaper for each queue pair;
+ * use one file (and one queue pair) per thread.
+ */
+
+static inline struct fchar_queue *
+fchar_queue_map(int fd, struct fchar_queue_params *params)
+{
+	struct fchar_queue *q;
+
+	if (ioctl(fd, FCHAR_IOCQSETUP, params) < 0)
+		return NULL;
+	q = mmap(NULL, params->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		 FCHAR_QUEUE_OFFSET);
+	return q == MAP_FAILED ? NULL : q;
+}
+
+static inline void fchar_queue_unmap(struct fchar_queue *q,
+				     struct fchar_queue_params *params)
+{
+	munmap(q, params->size);
+}
+
+/* Return the next free SQ entry, or NULL if the SQ is full */
+static inline struct fchar_sqe *fchar_queue_get_sqe(struct fchar_queue *q)
+{
+	struct fchar_sqe *sqes = (struct fchar_sqe *)((char *)q + q->sq_offset);
+	__u32 tail = q->sq_tail;
+
+	if (tail - fchar_ring_load(&q->sq_head) >= q->sq_entries)
+		return NULL;
+	return &sqes[tail & (q->sq_entries - 1)];
+}
+
+/* Publish the entry returned by fchar_queue_get_sqe() */
+static inline int fchar_queue_submit(int fd, struct fchar_queue *q)
+{
+	fchar_ring_store(&q->sq_tail, q->sq_tail + 1);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (fchar_ring_load(&q->flags) & FCHAR_QUEUE_NEED_WAKEUP)
+		return ioctl(fd, FCHAR_IOCQWAKE);
+	return 0;
+}
+
+/* Return 0 and copy the next completion to cqe, or -EAGAIN if none */
+static inline int fchar_queue_reap(struct fchar_queue *q, struct fchar_cqe *cqe)
+{
+	struct fchar_cqe *cqes = (struct fchar_cqe *)((char *)q + q->cq_offset);
+	__u32 head = q->cq_head;
+
+	if (head == fchar_ring_load(&q->cq_tail))
+		return -EAGAIN;
+	*cqe = cqes[head & (q->cq_entries - 1)];
+	fchar_ring_store(&q->cq_head, head + 1);
+	return 0;
+}
+
+#endif /* FCHAR_QUEUE_H */
@@ -0,0 +1,173 @@
+/*
+ * fchar-ring: lock-free userspace access to fchar ring devices
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Copyright (C) 2015 Andrea Righi <righi.andrea@gmail.com>
+ */
+
+#ifndef FCHAR_RING_H
+#define FCHAR_RING_H
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "fchar.h"
+
+/*
+ * Usage:
+ *
+ *	struct fchar_ring *ring = fchar_ring_map(fd);
+ *
+ *	fchar_ring_enqueue(ring, msg, len);
+ *	len = fchar_ring_dequeue(ring, buf, sizeof(buf));
+ *
+ * Both functions are safe to use from any number of threads and processes
+ * sharing the same device, including read() and write() on the device.
+ * They never block: -EAGAIN is returned when the ring is full (enqueue) or
+ * empty (dequeue).
+ */
+
+#define fchar_ring_load(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define fchar_ring_store(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static inline void fchar_ring_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__("pause" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline int fchar_ring_cas(__u32 *p, __u32 old, __u32 new)
+{
+	return __atomic_compare_exchange_n(p, &old, new, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline unsigned char *fchar_ring_data(struct fchar_ring *ring)
+{
+	return (unsigned char *)ring + ring->data_offset;
+}
+
+/* Wait for the preceding reservations, then publish ours */
+static inline void fchar_ring_publish(__u32 *tail, __u32 old, __u32 new)
+{
+	while (fchar_ring_load(tail) != old)
+		fchar_ring_cpu_relax();
+	fchar_ring_store(tail, new);
+}
+
+static inline struct fchar_ring *fchar_ring_map(int fd)
+{
+	struct fchar_ring *ring;
+	int size, flags;
+
+	if (ioctl(fd, FCHAR_IOCGFLAGS, &flags) < 0)
+		return NULL;
+	if (!(flags & FCHAR_F_RING)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (ioctl(fd, FCHAR_IOCGSIZE, &size) < 0)
+		return NULL;
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		return NULL;
+	if (ring->magic != FCHAR_RING_MAGIC ||
+			ring->version != FCHAR_RING_VERSION) {
+		munmap(ring, size);
+		errno = EPROTO;
+		return NULL;
+	}
+	return ring;
+}
+
+static inline int fchar_ring_enqueue(struct fchar_ring *ring,
+				     const void *buf, __u32 len)
+{
+	unsigned char *data = fchar_ring_data(ring);
+	__u32 size = ring->size, mask = size - 1;
+	__u32 total = FCHAR_RING_REC_SIZE(len);
+	__u32 head, next, off, pad;
+	struct fchar_ring_rec *rec;
+
+	if (total > size || total < len)
+		return -EMSGSIZE;
+	do {
+		head = fchar_ring_load(&ring->prod_head);
+		off = head & mask;
+		pad = (size - off < total) ? size - off : 0;
+		if (pad + total > size - (head - fchar_ring_load(&ring->cons_tail)))
+			return -EAGAIN;
+		next = head + pad + total;
+	} while (!fchar_ring_cas(&ring->prod_head, head, next));
+
+	if (pad) {
+		rec = (struct fchar_ring_rec *)(data + off);
+		rec->len = pad - sizeof(*rec);
+		rec->flags = FCHAR_RING_REC_PAD;
+		off = 0;
+	}
+	rec = (struct fchar_ring_rec *)(data + off);
+	rec->len = len;
+	rec->flags = 0;
+	memcpy(rec + 1, buf, len);
+
+	fchar_ring_publish(&ring->prod_tail, head, next);
+
+	return 0;
+}
+
+/*
+ * Return the length of the dequeued message, -EAGAIN if the ring is empty or
+ * -EMSGSIZE if the next message doesn't fit in buf (it's left in the ring).
+ */
+static inline int fchar_ring_dequeue(struct fchar_ring *ring,
+				     void *buf, __u32 len)
+{
+	unsigned char *data = fchar_ring_data(ring);
+	__u32 mask = ring->size - 1;
+	__u32 head, next, rec_len, rec_flags;
+	struct fchar_ring_rec *rec;
+
+	for (;;) {
+		do {
+			head = fchar_ring_load(&ring->cons_head);
+			if (head == fchar_ring_load(&ring->prod_tail))
+				return -EAGAIN;
+			rec = (struct fchar_ring_rec *)(data + (head & mask));
+			rec_len = rec->len;
+			rec_flags = rec->flags;
+			if (!(rec_flags & FCHAR_RING_REC_PAD) && rec_len > len)
+				return -EMSGSIZE;
+			next = head + FCHAR_RING_REC_SIZE(rec_len);
+		} while (!fchar_ring_cas(&ring->cons_head, head, next));
+
+		if (!(rec_flags & FCHAR_RING_REC_PAD))
+			memcpy(buf, rec + 1, rec_len);
+
+		fchar_ring_publish(&ring->cons_tail, head, next);
+
+		if (!(rec_flags & FCHAR_RING_REC_PAD))
+			return rec_len;
+	}
+}
+
+#endif /* FCHAR_RING_H */
@@ -0,0 +1,117 @@
+/*
+ * fchar-shard: userspace access to fchar sharded devices
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Copyright (C) 2015 Andrea Righi <righi.andrea@gmail.com>
+ */
+
+#ifndef FCHAR_SHARD_H
+#define FCHAR_SHARD_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "fchar.h"
+#include "fchar-ring.h"
+
+/*
+ * Usage:
+ *
+ *	struct fchar_shard *map = fchar_shard_map(fd);
+ *	__u32 *off = calloc(map->nr_shards, sizeof(*off));
+ *	struct fchar_shard_rec *rec;
+ *
+ *	while ((rec = fchar_shard_next(map, off)))
+ *		... rec->ts, rec->cpu, rec->len bytes at (rec + 1) ...
+ *
+ * off[] holds the position of the reader in each shard: the same merge done
+ * by read(), without copying the records. Records are appended by write()
+ * only; zero off[] again after FCHAR_IOCRESET.
+ */
+
+static inline struct fchar_shard *fchar_shard_map(int fd)
+{
+	struct fchar_shard *map;
+	int size, flags;
+
+	if (ioctl(fd, FCHAR_IOCGFLAGS, &flags) < 0)
+		return NULL;
+	if (!(flags & FCHAR_F_SHARDED)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (ioctl(fd, FCHAR_IOCGSIZE, &size) < 0)
+		return NULL;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	if (map->magic != FCHAR_SHARD_MAGIC ||
+			map->version != FCHAR_SHARD_VERSION) {
+		munmap(map, size);
+		errno = EPROTO;
+		return NULL;
+	}
+	return map;
+}
+
+static inline struct fchar_shard *fchar_shard_get(struct fchar_shard *map,
+						  unsigned int i)
+{
+	return (struct fchar_shard *)((char *)map + i * map->shard_size);
+}
+
+/* Next complete record of a shard at *off, skipping the padding ones */
+static inline struct fchar_shard_rec *
+fchar_shard_peek(struct fchar_shard *shard, __u32 *off)
+{
+	__u32 head = fchar_ring_load(&shard->head);
+	struct fchar_shard_rec *rec;
+
+	while (*off < head) {
+		rec = (struct fchar_shard_rec *)((char *)shard +
+				shard->data_offset + *off);
+		if (!(fchar_ring_load(&rec->flags) & FCHAR_SHARD_REC_COMMIT))
+			break;
+		if (!(rec->flags & FCHAR_SHARD_REC_PAD))
+			return rec;
+		*off += FCHAR_SHARD_REC_SIZE(rec->len);
+	}
+	return NULL;
+}
+
+/* Return the oldest record not read yet and move past it, or NULL */
+static inline struct fchar_shard_rec *fchar_shard_next(struct fchar_shard *map,
+						       __u32 *off)
+{
+	struct fchar_shard_rec *rec, *oldest = NULL;
+	unsigned int i, best = 0;
+
+	for (i = 0; i < map->nr_shards; i++) {
+		rec = fchar_shard_peek(fchar_shard_get(map, i), &off[i]);
+		if (rec && (!oldest || rec->ts < oldest->ts)) {
+			oldest = rec;
+			best = i;
+		}
+	}
+	if (oldest)
+		off[best] += FCHAR_SHARD_REC_SIZE(oldest->len);
+	return oldest;
+}
+
+#endif /* FCHAR_SHARD_H */
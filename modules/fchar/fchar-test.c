@@ -1,5 +1,5 @@
 /*
- * fchar-test: fast character device testcase
+ * fchar-test: fast character device benchmark
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public
@@ -19,8 +19,34 @@
  * Copyright (C) 2015 Andrea Righi <righi.andrea@gmail.com>
  */
 
+/*
+ * Every selected mode is run for every block size by N threads, each one
+ * working on its own slice of the device through its own file. A pass moves
+ * the whole slice one block at a time; WARMUP passes are run and discarded
+ * before the ITERATIONS measured ones, which start together on a barrier.
+ *
+ * Each combination prints a CSV line on stdout with the aggregate throughput
+ * (GB/s, wall clock of the measured passes) and the latency percentiles of a
+ * single operation (one system call, or one memcpy() in the mmap modes), and
+ * the CPU time used by the threads (plus the kernel workers of the queue
+ * modes) during the measured passes.
+ *
+ * batch-write writes each block as 64-byte records with one FCHAR_IOCBATCH:
+ * compare it with pwrite using a 64-byte block size. queue-fill submits each
+ * block as a fill operation through the submission queue of the thread:
+ * compare it with write (throughput and CPU time).
+ *
+ * append is write on a sharded device, where every thread appends to the
+ * shard of its CPU: the device is reset whenever a shard fills up. The
+ * other modes don't run on sharded devices, and append runs only there.
+ *
+ * The ring and poll modes measure the cross-process handoff latency instead:
+ * ITERATIONS messages (or wake-ups) are timed by a child process.
+ *
+ * Build: make fchar-test
+ */
+
 #define _GNU_SOURCE
-#define __USE_GNU
 
 #include <errno.h>
 #include <stdio.h>
@@ -30,142 +56,842 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <linux/fadvise.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <linux/aio_abi.h>
 
 #include "fchar.h"
+#include "fchar-ring.h"
+#include "fchar-queue.h"
+#include "fchar-shard.h"
+
+#define MAX_THREADS	256
+#define MAX_BLOCKS	32
+#define BATCH_RECORD	64
+#define QUEUE_ENTRIES	256
 
-#define MIN(a, b) (a < b) ? a : b
+struct worker {
+	pthread_t thread;
+	int id;
+	int cpu;
+	int fd;
+	off_t base;		/* start of the slice of this thread */
+	char *buf;
+	struct iovec *iov;
+	int nr_segs;
+	int pipe[2];
+	int null_fd;
+	aio_context_t ctx;
+	struct fchar_op *ops;
+	unsigned int nr_ops;
+	struct fchar_queue *q;
+	struct fchar_queue_params qp;
+	unsigned long inflight;
+	unsigned long long *lat;
+	size_t nr_lat;
+	unsigned long long start, stop;
+	double cpu_time;
+};
+
+struct bench_mode {
+	const char *name;
+	/* Move one block at offset off */
+	int (*op)(struct worker *w, off_t off);
+	/* Latency modes: run the whole test */
+	void (*run)(int fd, size_t bs);
+	/* Queue modes: wait for the completions at the end of each pass */
+	int (*sync)(struct worker *w);
+};
 
 static char *filename;
-static int use_mmap;
-static int iterations;
+static int iterations = 10;
+static int warmup = 2;
+static int spin_us = 50;
+static int nr_threads = 1;
+static int cpus[MAX_THREADS];
+static int nr_cpus;
+static size_t blocks[MAX_BLOCKS];
+static int nr_blocks;
+static size_t slice;
+static size_t dev_size;
+static int dev_flags;
+static char *map;
+
+/* Current test */
+static const struct bench_mode *mode;
+static size_t bs;
+static pthread_barrier_t barrier;
 
-static inline unsigned long long timeval(const struct timeval * time)
+static inline unsigned long long now_ns(void)
 {
-	return time->tv_sec * 1000000UL + time->tv_usec;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static inline float evaluate_bw(float size, float usec)
+/* CPU time of the calling thread, in seconds */
+static double thread_cpu(void)
 {
-	return (size * 1E6) / usec;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1E9;
 }
 
-static void do_rw(ssize_t size)
+/* CPU time of another task (the queue worker), in seconds */
+static double task_cpu(pid_t pid)
 {
-	void *buf;
-	ssize_t sz, page_size;
-	int i;
+	unsigned long utime, stime;
+	char path[64];
+	FILE *f;
 
-	page_size = sysconf(_SC_PAGESIZE);
-	if (page_size < 0) {
-		perror("sysconf");
-		exit(EXIT_FAILURE);
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		   "%lu %lu", &utime, &stime) != 2)
+		utime = stime = 0;
+	fclose(f);
+
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void fail(const char *msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long percentile(const unsigned long long *lat, size_t n,
+				     double p)
+{
+	size_t i = p * n / 100;
+
+	return lat[i < n ? i : n - 1];
+}
+
+static void report_header(void)
+{
+	printf("mode,block_size,threads,ops,bytes,seconds,gb_per_sec,cpu_sec,"
+	       "min_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+}
+
+static void report(const char *name, size_t block, int threads,
+		   unsigned long long *lat, size_t n,
+		   unsigned long long bytes, unsigned long long ns, double cpu)
+{
+	if (!n)
+		return;
+	qsort(lat, n, sizeof(*lat), cmp_ull);
+	printf("%s,%zu,%d,%zu,%llu,%.6f,%.3f,%.3f,"
+	       "%llu,%llu,%llu,%llu,%llu,%llu\n",
+	       name, block, threads, n, bytes, ns / 1E9,
+	       ns ? (double)bytes / ns : 0.0, cpu,
+	       lat[0], percentile(lat, n, 50), percentile(lat, n, 90),
+	       percentile(lat, n, 99), percentile(lat, n, 99.9), lat[n - 1]);
+	fflush(stdout);
+}
+
+static int op_read(struct worker *w, off_t off)
+{
+	return read(w->fd, w->buf, bs) == (ssize_t)bs ? 0 : -1;
+}
+
+static int op_write(struct worker *w, off_t off)
+{
+	return write(w->fd, w->buf, bs) == (ssize_t)bs ? 0 : -1;
+}
+
+static int op_append(struct worker *w, off_t off)
+{
+	for (;;) {
+		if (write(w->fd, w->buf, bs) == (ssize_t)bs)
+			return 0;
+		if (errno != ENOSPC || ioctl(w->fd, FCHAR_IOCRESET) < 0)
+			return -1;
 	}
-        buf = alloca(page_size);
-	memset(buf, 0xa0, page_size);
+}
+
+static int op_pread(struct worker *w, off_t off)
+{
+	return pread(w->fd, w->buf, bs, off) == (ssize_t)bs ? 0 : -1;
+}
 
-	for (i = 0; i < iterations; i++) {
-		struct timeval start, stop, diff;
-		unsigned long long time;
+static int op_pwrite(struct worker *w, off_t off)
+{
+	return pwrite(w->fd, w->buf, bs, off) == (ssize_t)bs ? 0 : -1;
+}
 
-		sz = size;
-		lseek(fileno(stdout), 0, SEEK_SET);
+static int op_mmap_read(struct worker *w, off_t off)
+{
+	memcpy(w->buf, map + off, bs);
+	return 0;
+}
 
-		gettimeofday(&start, NULL);
-		while (sz > 0) {
-			ssize_t written;
+static int op_mmap_write(struct worker *w, off_t off)
+{
+	memcpy(map + off, w->buf, bs);
+	return 0;
+}
 
-			written = write(fileno(stdout), buf,
-					MIN(size, page_size));
-			fprintf(stderr, "written=%d, sz=%d\n", written, sz);
-			if (written < 0) {
-				perror("write");
-				exit(EXIT_FAILURE);
-			}
-			sz -= written;
-		}
-		gettimeofday(&stop, NULL);
-		timersub(&stop, &start, &diff);
+static int op_readv(struct worker *w, off_t off)
+{
+	return readv(w->fd, w->iov, w->nr_segs) == (ssize_t)bs ? 0 : -1;
+}
+
+static int op_writev(struct worker *w, off_t off)
+{
+	return writev(w->fd, w->iov, w->nr_segs) == (ssize_t)bs ? 0 : -1;
+}
 
-		time = timeval(&diff);
+static int op_aio_write(struct worker *w, off_t off)
+{
+	struct iocb cb, *cbs[1] = { &cb };
+	struct io_event ev;
+
+	memset(&cb, 0, sizeof(cb));
+	cb.aio_fildes = w->fd;
+	cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+	cb.aio_buf = (unsigned long)w->buf;
+	cb.aio_nbytes = bs;
+	cb.aio_offset = off;
+	if (syscall(__NR_io_submit, w->ctx, 1, cbs) != 1 ||
+	    syscall(__NR_io_getevents, w->ctx, 1, 1, &ev, NULL) != 1)
+		return -1;
+	return ev.res == (long long)bs ? 0 : -1;
+}
+
+/* Write a block as BATCH_RECORD-sized records with a single ioctl() */
+static int op_batch_write(struct worker *w, off_t off)
+{
+	struct fchar_batch batch = {
+		.ops = (unsigned long)w->ops,
+		.nr = w->nr_ops,
+		.flags = FCHAR_BATCH_STOP_ON_ERROR,
+	};
+	unsigned int i;
 
-		fprintf(stderr,
-			"memset(): %-2d write %Lu usec [%.02f MiB/s]\n",
-			i, time, evaluate_bw((float)size, (float)time) / 1E6);
+	for (i = 0; i < w->nr_ops; i++)
+		w->ops[i].offset = off + i * BATCH_RECORD;
+	if (ioctl(w->fd, FCHAR_IOCBATCH, &batch) != (int)w->nr_ops)
+		return -1;
+	return w->ops[w->nr_ops - 1].result == w->ops[w->nr_ops - 1].len ?
+		0 : -1;
+}
+
+static int reap_queue(struct worker *w)
+{
+	struct fchar_cqe cqe;
+
+	while (fchar_queue_reap(w->q, &cqe) == 0) {
+		if (cqe.result != (long long)bs)
+			return -1;
+		w->inflight--;
+	}
+	return 0;
+}
+
+/* Fill a block through the submission queue, without any system call */
+static int op_queue_fill(struct worker *w, off_t off)
+{
+	struct fchar_sqe *sqe;
+
+	while (!(sqe = fchar_queue_get_sqe(w->q))) {
+		if (reap_queue(w) < 0)
+			return -1;
+		fchar_ring_cpu_relax();
+	}
+	sqe->opcode = FCHAR_OP_FILL;
+	sqe->value = 0xa0;
+	sqe->offset = off;
+	sqe->len = bs;
+	sqe->user_data = off;
+	w->inflight++;
+	if (fchar_queue_submit(w->fd, w->q) < 0)
+		return -1;
+	return reap_queue(w);
+}
+
+static int sync_queue(struct worker *w)
+{
+	while (w->inflight) {
+		if (reap_queue(w) < 0)
+			return -1;
+		fchar_ring_cpu_relax();
 	}
+	return 0;
 }
 
-static void do_mmap(ssize_t size)
+/* Move a block from the device to /dev/null through a pipe */
+static int op_splice(struct worker *w, off_t off)
 {
-        void *buf;
+	loff_t pos = off;
+	size_t left = bs;
+	ssize_t in, out;
+
+	while (left) {
+		in = splice(w->fd, &pos, w->pipe[1], NULL, left,
+			    SPLICE_F_MOVE);
+		if (in <= 0)
+			return -1;
+		left -= in;
+		while (in > 0) {
+			out = splice(w->pipe[0], NULL, w->null_fd, NULL, in,
+				     SPLICE_F_MOVE);
+			if (out <= 0)
+				return -1;
+			in -= out;
+		}
+	}
+	return 0;
+}
+
+static void run_ring(int fd, size_t size);
+static void run_poll(int fd, size_t size);
+
+static const struct bench_mode modes[] = {
+	{ "read",	op_read,	NULL,		NULL },
+	{ "write",	op_write,	NULL,		NULL },
+	{ "pread",	op_pread,	NULL,		NULL },
+	{ "pwrite",	op_pwrite,	NULL,		NULL },
+	{ "mmap-read",	op_mmap_read,	NULL,		NULL },
+	{ "mmap-write",	op_mmap_write,	NULL,		NULL },
+	{ "readv",	op_readv,	NULL,		NULL },
+	{ "writev",	op_writev,	NULL,		NULL },
+	{ "aio-write",	op_aio_write,	NULL,		NULL },
+	{ "splice",	op_splice,	NULL,		NULL },
+	{ "batch-write", op_batch_write, NULL,		NULL },
+	{ "queue-fill",	op_queue_fill,	NULL,		sync_queue },
+	{ "append",	op_append,	NULL,		NULL },
+	{ "ring",	NULL,		run_ring,	NULL },
+	{ "poll",	NULL,		run_poll,	NULL },
+};
+
+#define NR_MODES	(sizeof(modes) / sizeof(modes[0]))
+
+static void pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		fail("sched_setaffinity");
+}
+
+/* Split the block in (at most IOV_MAX) page-sized segments */
+static void setup_iovec(struct worker *w)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t seg, done = 0;
 	int i;
 
-	buf = mmap(NULL, size,
-			PROT_READ | PROT_WRITE, MAP_SHARED, fileno(stdout), 0);
-        if ((ssize_t)buf < 0) {
-		perror("mmap");
-		exit(EXIT_FAILURE);
-        }
+	w->nr_segs = (bs + page_size - 1) / page_size;
+	if (w->nr_segs > IOV_MAX)
+		w->nr_segs = IOV_MAX;
+	seg = bs / w->nr_segs;
+	w->iov = calloc(w->nr_segs, sizeof(*w->iov));
+	if (!w->iov)
+		fail("calloc");
+	for (i = 0; i < w->nr_segs; i++) {
+		w->iov[i].iov_base = w->buf + done;
+		w->iov[i].iov_len = (i == w->nr_segs - 1) ? bs - done : seg;
+		done += w->iov[i].iov_len;
+	}
+}
 
-	for (i = 0; i < iterations; i++) {
-		struct timeval start, stop, diff;
-		unsigned long long time;
+static void setup_batch(struct worker *w)
+{
+	unsigned int i;
 
-		gettimeofday(&start, NULL);
-		memset(buf, 0xa0, size);
-		gettimeofday(&stop, NULL);
-		timersub(&stop, &start, &diff);
+	w->nr_ops = (bs + BATCH_RECORD - 1) / BATCH_RECORD;
+	w->ops = calloc(w->nr_ops, sizeof(*w->ops));
+	if (!w->ops)
+		fail("calloc");
+	for (i = 0; i < w->nr_ops; i++) {
+		w->ops[i].opcode = FCHAR_OP_WRITE;
+		w->ops[i].addr = (unsigned long)(w->buf + i * BATCH_RECORD);
+		w->ops[i].len = (i == w->nr_ops - 1) ?
+			bs - i * BATCH_RECORD : BATCH_RECORD;
+	}
+}
+
+static void setup_queue(struct worker *w)
+{
+	w->qp.sq_entries = QUEUE_ENTRIES;
+	w->qp.cq_entries = QUEUE_ENTRIES * 2;
+	w->qp.spin_us = spin_us;
+	w->qp.cpu = -1;
+	w->q = fchar_queue_map(w->fd, &w->qp);
+	if (!w->q)
+		fail("fchar_queue_map");
+	w->inflight = 0;
+}
 
-		time = timeval(&diff);
+static void setup_worker(struct worker *w, size_t ops)
+{
+	w->fd = open(filename, O_RDWR);
+	if (w->fd < 0)
+		fail("open");
+	w->base = (off_t)w->id * slice;
+	if (posix_memalign((void **)&w->buf, sysconf(_SC_PAGESIZE), bs))
+		fail("posix_memalign");
+	memset(w->buf, 0xa0, bs);
+	w->nr_lat = ops * iterations;
+	w->lat = malloc(w->nr_lat * sizeof(*w->lat));
+	if (!w->lat)
+		fail("malloc");
+	setup_iovec(w);
+	setup_batch(w);
+	if (pipe(w->pipe) < 0)
+		fail("pipe");
+	/* A bigger pipe saves round trips, don't care if it's not allowed */
+	fcntl(w->pipe[1], F_SETPIPE_SZ, bs);
+	w->null_fd = open("/dev/null", O_WRONLY);
+	if (w->null_fd < 0)
+		fail("open");
+	w->ctx = 0;
+	if (syscall(__NR_io_setup, 1, &w->ctx) < 0)
+		fail("io_setup");
+	if (mode->sync)
+		setup_queue(w);
+}
+
+static void cleanup_worker(struct worker *w)
+{
+	if (w->q)
+		fchar_queue_unmap(w->q, &w->qp);
+	syscall(__NR_io_destroy, w->ctx);
+	close(w->null_fd);
+	close(w->pipe[0]);
+	close(w->pipe[1]);
+	free(w->ops);
+	free(w->iov);
+	free(w->lat);
+	free(w->buf);
+	close(w->fd);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	size_t ops = slice / bs, i, n = 0;
+	unsigned long long t;
+	int pass;
 
-		fprintf(stderr,
-			"memset(): %-2d mmap() write %Lu usec [%.02f MiB/s]\n",
-			i, time, evaluate_bw((float)size, (float)time) / 1E6);
+	pin_cpu(w->cpu);
+	for (pass = 0; pass < warmup + iterations; pass++) {
+		if (pass == warmup) {
+			pthread_barrier_wait(&barrier);
+			w->start = now_ns();
+			w->cpu_time = -thread_cpu();
+			if (w->q)
+				w->cpu_time -= task_cpu(w->qp.pid);
+		}
+		if (lseek(w->fd, w->base, SEEK_SET) < 0)
+			fail("lseek");
+		for (i = 0; i < ops; i++) {
+			t = now_ns();
+			if (mode->op(w, w->base + i * bs) < 0)
+				fail(mode->name);
+			if (pass >= warmup)
+				w->lat[n++] = now_ns() - t;
+		}
+		if (mode->sync && mode->sync(w) < 0)
+			fail(mode->name);
 	}
+	w->stop = now_ns();
+	w->cpu_time += thread_cpu();
+	if (w->q)
+		w->cpu_time += task_cpu(w->qp.pid);
 
-	if (munmap(buf, size) < 0) {
-		perror("munmap");
-		exit(EXIT_FAILURE);
+	return NULL;
+}
+
+static void run_threads(void)
+{
+	static struct worker workers[MAX_THREADS];
+	unsigned long long start = ~0ULL, stop = 0, *lat;
+	size_t ops = slice / bs, n = 0;
+	double cpu = 0;
+	int i;
+
+	if (!ops) {
+		fprintf(stderr, "%s: block size %zu larger than the slice, "
+			"skipped\n", mode->name, bs);
+		return;
+	}
+	if (pthread_barrier_init(&barrier, NULL, nr_threads))
+		fail("pthread_barrier_init");
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+
+		memset(w, 0, sizeof(*w));
+		w->id = i;
+		w->cpu = nr_cpus ? cpus[i % nr_cpus] : -1;
+		setup_worker(w, ops);
+		if (pthread_create(&w->thread, NULL, worker_fn, w))
+			fail("pthread_create");
+	}
+	lat = malloc(ops * iterations * nr_threads * sizeof(*lat));
+	if (!lat)
+		fail("malloc");
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		if (w->start < start)
+			start = w->start;
+		if (w->stop > stop)
+			stop = w->stop;
+		memcpy(lat + n, w->lat, w->nr_lat * sizeof(*lat));
+		n += w->nr_lat;
+		cpu += w->cpu_time;
+		cleanup_worker(w);
 	}
+	pthread_barrier_destroy(&barrier);
+
+	report(mode->name, bs, nr_threads, lat, n, (unsigned long long)n * bs,
+	       stop - start, cpu);
+	free(lat);
 }
 
-int main(int argc, char **argv)
+/*
+ * Cross-process handoff latency of the ring: the parent enqueues messages
+ * carrying their send time, a child process busy-polls the ring and computes
+ * the delay of each message.
+ */
+static void run_ring(int fd, size_t size)
 {
-	ssize_t size;
-	int fd;
+	struct fchar_ring *ring;
+	unsigned long long *msg;
+	int i, total = warmup + iterations;
+	pid_t pid;
 
-	if (argc < 5) {
-		fprintf(stderr,
-			"%s DEVICE SIZE ITERATIONS USE_MMAP\n", argv[0]);
-		exit(EXIT_FAILURE);
+	if (size < sizeof(*msg))
+		size = sizeof(*msg);
+	ring = fchar_ring_map(fd);
+	if (!ring)
+		fail("fchar_ring_map");
+	msg = malloc(size);
+	if (!msg)
+		fail("malloc");
+	memset(msg, 0xa0, size);
+
+	pid = fork();
+	if (pid < 0)
+		fail("fork");
+	if (!pid) {
+		unsigned long long *lat, start = 0;
+		double cpu = 0;
+
+		pin_cpu(nr_cpus > 1 ? cpus[1] : -1);
+		lat = malloc(iterations * sizeof(*lat));
+		if (!lat)
+			fail("malloc");
+		for (i = 0; i < total; i++) {
+			while (fchar_ring_dequeue(ring, msg, size) < 0)
+				fchar_ring_cpu_relax();
+			if (i == warmup) {
+				start = msg[0];
+				cpu = -thread_cpu();
+			}
+			if (i >= warmup)
+				lat[i - warmup] = now_ns() - msg[0];
+		}
+		report("ring", size, 1, lat, iterations,
+		       (unsigned long long)iterations * size, now_ns() - start,
+		       cpu + thread_cpu());
+		exit(EXIT_SUCCESS);
 	}
-	filename = argv[1];
-	size = strtol(argv[2], (char **)NULL, 10);
-	iterations = strtol(argv[3], (char **)NULL, 10);
-	use_mmap = strtol(argv[4], (char **)NULL, 10);
+	pin_cpu(nr_cpus ? cpus[0] : -1);
+	for (i = 0; i < total; i++) {
+		/* Hand over one message at a time */
+		while (fchar_ring_load(&ring->cons_tail) !=
+				fchar_ring_load(&ring->prod_tail))
+			fchar_ring_cpu_relax();
+		msg[0] = now_ns();
+		while (fchar_ring_enqueue(ring, msg, size) < 0)
+			fchar_ring_cpu_relax();
+	}
+	waitpid(pid, NULL, 0);
+	free(msg);
+}
 
-	setbuf(stdout, NULL);
-	setbuf(stderr, NULL);
+/*
+ * Wake-up latency of the readiness notification: the parent stores a
+ * timestamp through mmap() and issues FCHAR_IOCCOMMIT, a child process
+ * sleeping in epoll_wait() on its own file computes the delay.
+ */
+static void run_poll(int fd, size_t size)
+{
+	volatile unsigned long long *stamp;
+	int i, total = warmup + iterations;
+	int sync[2];
+	char c = 0;
+	pid_t pid;
 
-        if ((fd = open(filename, O_RDWR | O_SYNC)) < 0) {
-		perror("open");
-		exit(EXIT_FAILURE);
-        }
-	if (!size) {
-		if (ioctl(fd, FCHAR_IOCGSIZE, &size) < 0) {
-			perror("ioctl");
+	stamp = mmap(NULL, sysconf(_SC_PAGESIZE),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (stamp == MAP_FAILED || pipe(sync) < 0)
+		fail("setup");
+	pid = fork();
+	if (pid < 0)
+		fail("fork");
+	if (!pid) {
+		struct epoll_event ev = { .events = EPOLLIN };
+		unsigned long long *lat, start = 0;
+		double cpu = 0;
+		__u32 gen;
+		int efd, rfd;
+
+		pin_cpu(nr_cpus > 1 ? cpus[1] : -1);
+		lat = malloc(iterations * sizeof(*lat));
+		rfd = open(filename, O_RDONLY);
+		efd = epoll_create(1);
+		if (!lat || rfd < 0 || efd < 0 ||
+		    epoll_ctl(efd, EPOLL_CTL_ADD, rfd, &ev) < 0)
+			fail("epoll");
+		ioctl(rfd, FCHAR_IOCGGEN, &gen);
+		if (write(sync[1], &c, 1) != 1)
 			exit(EXIT_FAILURE);
+		for (i = 0; i < total; i++) {
+			if (epoll_wait(efd, &ev, 1, -1) != 1)
+				fail("epoll_wait");
+			if (i == warmup) {
+				start = stamp[0];
+				cpu = -thread_cpu();
+			}
+			if (i >= warmup)
+				lat[i - warmup] = now_ns() - stamp[0];
+			ioctl(rfd, FCHAR_IOCGGEN, &gen);
+			if (write(sync[1], &c, 1) != 1)
+				exit(EXIT_FAILURE);
+		}
+		report("poll", sizeof(*stamp), 1, lat, iterations,
+		       (unsigned long long)iterations * sizeof(*stamp),
+		       now_ns() - start, cpu + thread_cpu());
+		exit(EXIT_SUCCESS);
+	}
+	pin_cpu(nr_cpus ? cpus[0] : -1);
+	for (i = 0; i < total; i++) {
+		/* Wait for the reader to be back in epoll_wait() */
+		if (read(sync[0], &c, 1) != 1)
+			fail("read");
+		usleep(100);
+		stamp[0] = now_ns();
+		if (ioctl(fd, FCHAR_IOCCOMMIT) < 0)
+			fail("ioctl");
+	}
+	waitpid(pid, NULL, 0);
+	munmap((void *)stamp, sysconf(_SC_PAGESIZE));
+	close(sync[0]);
+	close(sync[1]);
+}
+
+/* Write the whole device once, so that the read modes don't just hit holes */
+static void prefill(int fd)
+{
+	size_t chunk = 1 << 20, off;
+	char *buf;
+
+	buf = malloc(chunk);
+	if (!buf)
+		fail("malloc");
+	memset(buf, 0xa5, chunk);
+	for (off = 0; off < dev_size; off += chunk) {
+		size_t len = dev_size - off < chunk ? dev_size - off : chunk;
+
+		if (pwrite(fd, buf, len, off) != (ssize_t)len)
+			fail("pwrite");
+	}
+	free(buf);
+}
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t val = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		val <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		val <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		val <<= 10;
+	}
+	return val;
+}
+
+static const struct bench_mode *parse_mode(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_MODES; i++)
+		if (!strcmp(modes[i].name, name))
+			return &modes[i];
+	fprintf(stderr, "unknown mode: %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr,
+		"%s [OPTIONS] DEVICE\n"
+		"  -m MODE[,MODE...]  modes to run (default: all but ring,poll)\n"
+		"  -b SIZE[,SIZE...]  block sizes (default: 4k,64k,1m)\n"
+		"  -t THREADS         number of threads (default: 1)\n"
+		"  -c CPU[,CPU...]    pin thread i to the (i %% n)-th CPU\n"
+		"  -s SIZE            slice of the device for each thread\n"
+		"                     (default: device size / threads)\n"
+		"  -n ITERATIONS      measured passes, or messages (default: 10)\n"
+		"  -w WARMUP          discarded passes, or messages (default: 2)\n"
+		"  -p SPIN_US         busy-poll time of the queue worker "
+		"(default: 50)\n"
+		"MODE:", prog);
+	for (i = 0; i < NR_MODES; i++)
+		fprintf(stderr, " %s", modes[i].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const struct bench_mode *selected[NR_MODES];
+	unsigned int nr_selected = 0, i;
+	char *tok;
+	int fd, opt, b, size;
+
+	while ((opt = getopt(argc, argv, "m:b:t:c:s:n:w:p:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (tok = strtok(optarg, ","); tok;
+			     tok = strtok(NULL, ","))
+				if (nr_selected < NR_MODES)
+					selected[nr_selected++] =
+						parse_mode(tok);
+			break;
+		case 'b':
+			for (tok = strtok(optarg, ","); tok;
+			     tok = strtok(NULL, ","))
+				if (nr_blocks < MAX_BLOCKS)
+					blocks[nr_blocks++] = parse_size(tok);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'c':
+			for (tok = strtok(optarg, ","); tok;
+			     tok = strtok(NULL, ","))
+				if (nr_cpus < MAX_THREADS)
+					cpus[nr_cpus++] = atoi(tok);
+			break;
+		case 's':
+			slice = parse_size(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 'p':
+			spin_us = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
 		}
 	}
-	dup2(fd, fileno(stdout));
+	if (optind >= argc || nr_threads < 1 || nr_threads > MAX_THREADS ||
+	    iterations < 1 || warmup < 0)
+		usage(argv[0]);
+	filename = argv[optind];
+	if (!nr_selected)
+		for (i = 0; i < NR_MODES; i++)
+			if (modes[i].op)
+				selected[nr_selected++] = &modes[i];
+	if (!nr_blocks) {
+		blocks[nr_blocks++] = 4 << 10;
+		blocks[nr_blocks++] = 64 << 10;
+		blocks[nr_blocks++] = 1 << 20;
+	}
+	for (b = 0; b < nr_blocks; b++)
+		if (!blocks[b])
+			usage(argv[0]);
 
-	if (use_mmap)
-		do_mmap(size);
-	else
-		do_rw(size);
+	fd = open(filename, O_RDWR);
+	if (fd < 0)
+		fail("open");
+	if (ioctl(fd, FCHAR_IOCGSIZE, &size) < 0 ||
+	    ioctl(fd, FCHAR_IOCGFLAGS, &dev_flags) < 0)
+		fail("ioctl");
+	dev_size = size;
+	if (!slice)
+		slice = dev_size / nr_threads;
+	if (slice * nr_threads > dev_size) {
+		fprintf(stderr, "%d slices of %zu bytes don't fit in %zu\n",
+			nr_threads, slice, dev_size);
+		exit(EXIT_FAILURE);
+	}
+	if (!(dev_flags & (FCHAR_F_RING | FCHAR_F_SHARDED))) {
+		prefill(fd);
+		map = mmap(NULL, dev_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			fail("mmap");
+	}
+
+	report_header();
+	for (i = 0; i < nr_selected; i++) {
+		mode = selected[i];
+		if (mode->run == run_poll) {
+			mode->run(fd, 0);
+			continue;
+		}
+		for (b = 0; b < nr_blocks; b++) {
+			bs = blocks[b];
+			if (mode->run)
+				mode->run(fd, bs);
+			else if (dev_flags & FCHAR_F_RING)
+				fprintf(stderr, "%s: not supported on ring "
+					"devices, skipped\n", mode->name);
+			else if (!(dev_flags & FCHAR_F_SHARDED) !=
+					(mode->op != op_append))
+				fprintf(stderr, "%s: %s sharded devices, "
+					"skipped\n", mode->name,
+					mode->op == op_append ?
+					"only for" : "not supported on");
+			else
+				run_threads();
+		}
+	}
+	if (map)
+		munmap(map, dev_size);
 	close(fd);
 
 	return 0;
@@ -29,8 +29,23 @@
 #include <linux/vmalloc.h>
 #include <linux/sched.h>
 #include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/uio.h>
+#include <linux/aio.h>
 #include <linux/mm.h>
+#include <linux/pagemap.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/kthread.h>
+#include <linux/srcu.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "fchar.h"
 
@@ -39,131 +54,2508 @@
 		if (unlikely(fchar_debug))			\
 			printk(KERN_DEBUG "fchar: " msg);	\
 	} while (0)
+
+/*
+ * FCHAR_F_HUGE devices are backed by physically contiguous chunks of this
+ * order (the PMD size, when the page allocator can provide it).
+ */
+#define FCHAR_HUGE_ORDER	min(PMD_SHIFT - PAGE_SHIFT, MAX_ORDER - 1)
+#define FCHAR_HUGE_SIZE		(PAGE_SIZE << FCHAR_HUGE_ORDER)
+
+/* Record-oriented devices: no random access through read() and write() */
+#define FCHAR_F_RECORDS		(FCHAR_F_RING | FCHAR_F_SHARDED)
+
+#define DEFAULT_FCHAR_NR	1
+#define FCHAR_MAX_NR		32
+#define DEFAULT_FCHAR_SIZE	(PAGE_SIZE * 8)
+
+static int fchar_nr = DEFAULT_FCHAR_NR;
+module_param(fchar_nr, int, 0);
+MODULE_PARM_DESC(fchar_nr, "Number of shared devices (minors)");
+
+static int fchar_size = DEFAULT_FCHAR_SIZE;
+module_param(fchar_size, int, 0);
+MODULE_PARM_DESC(fchar_size, "Default size of each device in bytes");
+
+static int fchar_max_size;
+module_param(fchar_max_size, int, 0);
+MODULE_PARM_DESC(fchar_max_size,
+	"Maximum size of plain devices with FCHAR_IOCSSIZE (0 = initial size)");
+
+static int fchar_sizes[FCHAR_MAX_NR];
+static int fchar_sizes_nr;
+module_param_array(fchar_sizes, int, &fchar_sizes_nr, 0);
+MODULE_PARM_DESC(fchar_sizes,
+	"Per-minor device sizes in bytes (0 = use fchar_size)");
+
+static char *fchar_files[FCHAR_MAX_NR];
+static int fchar_files_nr;
+module_param_array(fchar_files, charp, &fchar_files_nr, 0);
+MODULE_PARM_DESC(fchar_files,
+	"Per-minor backing files of plain devices (empty = volatile)");
+
+static int fchar_flags[FCHAR_MAX_NR];
+static int fchar_flags_nr;
+module_param_array(fchar_flags, int, &fchar_flags_nr, 0);
+MODULE_PARM_DESC(fchar_flags,
+	"Per-minor device flags (FCHAR_F_*, 1 = ring, 2 = huge)");
+
+static unsigned int fchar_wake_coalesce_us;
+module_param(fchar_wake_coalesce_us, uint, 0644);
+MODULE_PARM_DESC(fchar_wake_coalesce_us,
+	"Minimum interval between reader wake-ups in usec (0 = immediate)");
+
+static int fchar_debug;
+module_param(fchar_debug, int, 0644);
+MODULE_PARM_DESC(fchar_debug, "Enable module debugging");
+
+/*
+ * A single fast-character buffer.
+ *
+ * Shared devices (minors 0 .. fchar_nr - 1) are allocated on first open and
+ * live until the module is unloaded. The private device (minor fchar_nr)
+ * allocates a new instance for each open file, freed on release.
+ */
+struct fchar_dev {
+	unsigned char *data;	/* ring and huge devices: linear mapping */
+	struct page **pages;	/* plain devices: sparse, see fchar_get_page() */
+	size_t size;		/* see fchar_dev_size() */
+	size_t max_size;	/* plain devices: limit of FCHAR_IOCSSIZE */
+	struct inode *inode;	/* its mapping is shared by all the files */
+	int minor;
+	int node;
+	int flags;
+	bool private;
+	struct mutex lock;	/* serializes the allocation of data and resizes */
+
+	/* FCHAR_F_HUGE: physically contiguous chunks, vmap()ed at data */
+	struct page **chunks;
+	unsigned int nr_chunks;
+
+	/* FCHAR_F_SHARDED: one shard per possible CPU */
+	unsigned int nr_shards;
+	size_t shard_size;
+	bool resetting;		/* FCHAR_IOCRESET in progress */
+	u32 shard_gen;		/* bumped by FCHAR_IOCRESET */
+	wait_queue_head_t reset_wait;
+
+	/* Persistence of plain devices, see fchar_flush() */
+	const char *store_path;
+	struct file *store;	/* backing file */
+	unsigned long *dirty;	/* pages not written back yet */
+
+#ifdef FCHAR_HEAT
+	/* Access counters, see fchar_heat() */
+	struct fchar_heat **heat;	/* per CPU, one entry per page */
+#endif
+
+	/* Page-range consistency of read() and write() (not in ring mode) */
+	unsigned int *seq;	/* per-page sequence counters */
+	spinlock_t range_lock;	/* protects ranges */
+	struct list_head ranges;	/* page ranges locked by writers */
+	wait_queue_head_t range_wait;
+
+	/* Readiness notification (poll) */
+	wait_queue_head_t wait;
+	atomic_t gen;		/* bumped by every write or commit */
+	ktime_t last_wake;
+	unsigned long wake_pending;
+	struct hrtimer wake_timer;
+};
+
+/* Submission/completion queues of a file, run by a kernel worker */
+struct fchar_queue_ctx {
+	struct fchar_dev *dev;
+	struct fchar_queue *hdr;	/* shared with userspace */
+	struct fchar_sqe *sqes;
+	struct fchar_cqe *cqes;
+	size_t size;
+	u32 sq_mask, cq_mask;
+	u32 sq_head, cq_tail;		/* owned by the worker */
+	u64 spin_ns;
+	wait_queue_head_t wait;
+	struct task_struct *task;
+};
+
+/* Per open file state */
+struct fchar_file {
+	struct fchar_dev *dev;
+	u32 seen;		/* last generation observed through this file */
+	struct fchar_queue_ctx *queue;
+	struct fchar_shard_iter *iter;	/* FCHAR_F_SHARDED: read() position */
+};
+
+/* Fast-character device structures */
+static int major;
+static struct class *fchar_class;
+static struct cdev fchar_cdev;
+static struct fchar_dev *fchar_devs;
+
+/* Users of the pages of plain devices, see fchar_resize() */
+static struct srcu_struct fchar_srcu;
+
+static void *alloc_data(ssize_t size, int node);
+static void free_data(const void *mem, ssize_t size);
+static void *alloc_huge_data(struct fchar_dev *dev, int node);
+static void free_huge_data(struct fchar_dev *dev);
+static struct page **alloc_sparse_data(ssize_t size, int node);
+static void free_sparse_data(struct fchar_dev *dev);
+static void fchar_queue_destroy(struct fchar_queue_ctx *q);
+static int fchar_flush(struct fchar_dev *dev);
+
+static inline struct fchar_dev *fchar_dev(struct file *filp)
+{
+	return ((struct fchar_file *)filp->private_data)->dev;
+}
+
+/*
+ * The size of plain devices changes with FCHAR_IOCSSIZE: sample it once,
+ * within fchar_srcu, and stick to that value for the whole operation.
+ */
+static inline size_t fchar_dev_size(struct fchar_dev *dev)
+{
+	return ACCESS_ONCE(dev->size);
+}
+
+static inline size_t size_inside_page(unsigned long start,
+				      unsigned long size)
+{
+	unsigned long sz;
+
+	sz = PAGE_SIZE - (start & (PAGE_SIZE - 1));
+
+	return min(sz, size);
+}
+
+/*
+ * Plain devices are sparse: each page is allocated by the first write() or
+ * page fault that touches it and the holes read as zeroes, so memory tracks
+ * the actual use of the device. Ring and huge devices are fully populated
+ * when they are allocated and linearly mapped at data.
+ */
+static inline bool fchar_sparse(struct fchar_dev *dev)
+{
+	return !(dev->flags & (FCHAR_F_RING | FCHAR_F_HUGE | FCHAR_F_SHARDED));
+}
+
+static inline struct page *fchar_lookup_page(struct fchar_dev *dev,
+					     pgoff_t index)
+{
+	struct page *page = ACCESS_ONCE(dev->pages[index]);
+
+	/* Pairs with the cmpxchg() in fchar_get_page() */
+	smp_read_barrier_depends();
+	return page;
+}
+
+/* Read a page of the backing file, what is past its end reads as zeroes */
+static int fchar_store_read(struct fchar_dev *dev, struct page *page,
+			    pgoff_t index)
+{
+	int ret;
+
+	ret = kernel_read(dev->store, (loff_t)index << PAGE_SHIFT,
+			  page_address(page), PAGE_SIZE);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Return the page at @index, filling the hole if there is one: with a
+ * backing file, holes are the pages that haven't been loaded yet.
+ */
+static struct page *fchar_get_page(struct fchar_dev *dev, pgoff_t index)
+{
+	struct page *page, *old;
+	int ret;
+
+	page = fchar_lookup_page(dev, index);
+	if (likely(page))
+		return page;
+	page = alloc_pages_node(dev->node, GFP_KERNEL | __GFP_ZERO, 0);
+	if (unlikely(!page))
+		return ERR_PTR(-ENOMEM);
+	if (dev->store) {
+		ret = fchar_store_read(dev, page, index);
+		if (unlikely(ret)) {
+			__free_page(page);
+			return ERR_PTR(ret);
+		}
+	}
+	old = cmpxchg(&dev->pages[index], NULL, page);
+	if (unlikely(old)) {
+		/* Somebody else filled it first */
+		__free_page(page);
+		return old;
+	}
+	return page;
+}
+
+/*
+ * Kernel address of the byte at offset @p. Holes are filled when @alloc is
+ * set or loaded when there is a backing file, otherwise NULL is returned for
+ * them. Failures are returned as ERR_PTR().
+ */
+static void *fchar_addr(struct fchar_dev *dev, loff_t p, bool alloc)
+{
+	struct page *page;
+
+	if (!fchar_sparse(dev))
+		return dev->data + p;
+	if (alloc || dev->store)
+		page = fchar_get_page(dev, p >> PAGE_SHIFT);
+	else
+		page = fchar_lookup_page(dev, p >> PAGE_SHIFT);
+	if (IS_ERR_OR_NULL(page))
+		return page;
+
+	return page_address(page) + offset_in_page(p);
+}
+
+/*
+ * Readiness notification: every write(), or FCHAR_IOCCOMMIT for writers
+ * using mmap(), bumps the device generation and wakes up the pollers. With
+ * fchar_wake_coalesce_us set, wake-ups closer than that are deferred to a
+ * timer, so a burst of commits costs a single wake-up.
+ */
+static void fchar_wake(struct fchar_dev *dev)
+{
+	dev->last_wake = ktime_get();
+	wake_up_interruptible_poll(&dev->wait,
+			POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+}
+
+static enum hrtimer_restart fchar_wake_timer(struct hrtimer *timer)
+{
+	struct fchar_dev *dev = container_of(timer, struct fchar_dev,
+					     wake_timer);
+
+	clear_bit(0, &dev->wake_pending);
+	fchar_wake(dev);
+
+	return HRTIMER_NORESTART;
+}
+
+static void fchar_notify(struct fchar_dev *dev)
+{
+	unsigned int coalesce = ACCESS_ONCE(fchar_wake_coalesce_us);
+	s64 delta;
+
+	atomic_inc(&dev->gen);
+	/* Pairs with the barrier in poll_wait()/prepare_to_wait() */
+	smp_mb();
+	if (!waitqueue_active(&dev->wait))
+		return;
+	if (!coalesce) {
+		fchar_wake(dev);
+		return;
+	}
+	delta = ktime_us_delta(ktime_get(), dev->last_wake);
+	if (delta >= coalesce) {
+		fchar_wake(dev);
+		return;
+	}
+	if (!test_and_set_bit(0, &dev->wake_pending))
+		hrtimer_start(&dev->wake_timer,
+			ns_to_ktime((coalesce - delta) * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+}
+
+/*
+ * Ring mode: see the protocol description in fchar.h.
+ *
+ * The header and the data area are shared with userspace, so nothing read
+ * from them can be trusted: offsets are always masked and record sizes are
+ * checked against the data area before being used.
+ */
+static inline struct fchar_ring *fchar_ring(struct fchar_dev *dev)
+{
+	return (struct fchar_ring *)dev->data;
+}
+
+static void fchar_ring_init(struct fchar_dev *dev)
+{
+	struct fchar_ring *ring = fchar_ring(dev);
+
+	BUILD_BUG_ON(sizeof(*ring) > PAGE_SIZE);
+
+	ring->magic = FCHAR_RING_MAGIC;
+	ring->version = FCHAR_RING_VERSION;
+	ring->data_offset = PAGE_SIZE;
+	ring->size = dev->size - PAGE_SIZE;
+	ring->flags = 0;
+	ring->prod_head = ring->prod_tail = 0;
+	ring->cons_head = ring->cons_tail = 0;
+}
+
+/*
+ * Wait for the preceding reservations, then publish ours. The tail lives in
+ * the shared header: a publisher that died (or a process scribbling on the
+ * mapping) can keep it away from @old forever, so give up on fatal signals
+ * and after FCHAR_RING_PUBLISH_TIMEOUT, leaving our reservation unpublished.
+ */
+#define FCHAR_RING_PUBLISH_TIMEOUT	HZ
+
+static int fchar_ring_publish(u32 *tail, u32 old, u32 new)
+{
+	unsigned long timeout = jiffies + FCHAR_RING_PUBLISH_TIMEOUT;
+
+	while (ACCESS_ONCE(*tail) != old) {
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		if (time_after(jiffies, timeout))
+			return -EIO;
+		cpu_relax();
+		cond_resched();
+	}
+	smp_mb();
+	ACCESS_ONCE(*tail) = new;
+	return 0;
+}
+
+static int fchar_copy_from_iovec(void *dst, const struct iovec *iov,
+				 unsigned long nr_segs, size_t count)
+{
+	unsigned long seg;
+
+	for (seg = 0; seg < nr_segs && count; seg++) {
+		size_t len = min(iov[seg].iov_len, count);
+
+		if (copy_from_user(dst, iov[seg].iov_base, len))
+			return -EFAULT;
+		dst += len;
+		count -= len;
+	}
+	return 0;
+}
+
+static int fchar_copy_to_iovec(const struct iovec *iov, unsigned long nr_segs,
+			       const void *src, size_t count)
+{
+	unsigned long seg;
+
+	for (seg = 0; seg < nr_segs && count; seg++) {
+		size_t len = min(iov[seg].iov_len, count);
+
+		if (copy_to_user(iov[seg].iov_base, src, len))
+			return -EFAULT;
+		src += len;
+		count -= len;
+	}
+	return 0;
+}
+
+/* Enqueue the (gathered) iovec as a single message */
+static ssize_t fchar_ring_write(struct fchar_dev *dev,
+				const struct iovec *iov, unsigned long nr_segs,
+				size_t count)
+{
+	struct fchar_ring *ring = fchar_ring(dev);
+	unsigned char *data = dev->data + PAGE_SIZE;
+	u32 size = dev->size - PAGE_SIZE, mask = size - 1;
+	u32 head, next, off, pad, total;
+	struct fchar_ring_rec *rec;
+	ssize_t ret = count;
+	int err;
+
+	if (count > size - sizeof(*rec))
+		return -EMSGSIZE;
+	total = FCHAR_RING_REC_SIZE(count);
+	if (total > size)
+		return -EMSGSIZE;
+	do {
+		head = ACCESS_ONCE(ring->prod_head);
+		off = head & mask;
+		if (unlikely(off & (FCHAR_RING_ALIGN - 1)))
+			return -EIO;
+		pad = (size - off < total) ? size - off : 0;
+		smp_rmb();
+		if (pad + total > size - (head - ACCESS_ONCE(ring->cons_tail)))
+			return -EAGAIN;
+		next = head + pad + total;
+	} while (cmpxchg(&ring->prod_head, head, next) != head);
+
+	if (pad) {
+		rec = (struct fchar_ring_rec *)(data + off);
+		rec->len = pad - sizeof(*rec);
+		rec->flags = FCHAR_RING_REC_PAD;
+		off = 0;
+	}
+	rec = (struct fchar_ring_rec *)(data + off);
+	if (likely(!fchar_copy_from_iovec(rec + 1, iov, nr_segs, count))) {
+		rec->len = count;
+		rec->flags = 0;
+	} else {
+		/* The space is reserved: turn it into padding */
+		rec->len = total - sizeof(*rec);
+		rec->flags = FCHAR_RING_REC_PAD;
+		ret = -EFAULT;
+	}
+	err = fchar_ring_publish(&ring->prod_tail, head, next);
+
+	return err ? err : ret;
+}
+
+/* Dequeue a single message, scattering it over the iovec */
+static ssize_t fchar_ring_read(struct fchar_dev *dev,
+				const struct iovec *iov, unsigned long nr_segs,
+				size_t count)
+{
+	struct fchar_ring *ring = fchar_ring(dev);
+	unsigned char *data = dev->data + PAGE_SIZE;
+	u32 size = dev->size - PAGE_SIZE, mask = size - 1;
+	u32 head, tail, next, off, len, flags, total;
+	struct fchar_ring_rec *rec;
+	ssize_t ret;
+	int err;
+
+	for (;;) {
+		do {
+			head = ACCESS_ONCE(ring->cons_head);
+			tail = ACCESS_ONCE(ring->prod_tail);
+			if (head == tail)
+				return -EAGAIN;
+			smp_rmb();
+			off = head & mask;
+			if (unlikely(off & (FCHAR_RING_ALIGN - 1)))
+				return -EIO;
+			rec = (struct fchar_ring_rec *)(data + off);
+			len = ACCESS_ONCE(rec->len);
+			flags = ACCESS_ONCE(rec->flags);
+			if (unlikely(len > size - off - sizeof(*rec)))
+				return -EIO;
+			total = FCHAR_RING_REC_SIZE(len);
+			if (unlikely(total > tail - head))
+				return -EIO;
+			if (!(flags & FCHAR_RING_REC_PAD) && len > count)
+				return -EMSGSIZE;
+			next = head + total;
+		} while (cmpxchg(&ring->cons_head, head, next) != head);
+
+		ret = len;
+		if (!(flags & FCHAR_RING_REC_PAD) &&
+				fchar_copy_to_iovec(iov, nr_segs, rec + 1, len))
+			ret = -EFAULT;
+
+		err = fchar_ring_publish(&ring->cons_tail, head, next);
+		if (unlikely(err))
+			return err;
+
+		if (!(flags & FCHAR_RING_REC_PAD))
+			return ret;
+	}
+}
+
+static bool fchar_ring_empty(struct fchar_dev *dev)
+{
+	struct fchar_ring *ring = fchar_ring(dev);
+
+	return ACCESS_ONCE(ring->cons_head) == ACCESS_ONCE(ring->prod_tail);
+}
+
+/* Check if a message of @count bytes can be reserved right now */
+static bool fchar_ring_fits(struct fchar_dev *dev, size_t count)
+{
+	struct fchar_ring *ring = fchar_ring(dev);
+	u32 size = dev->size - PAGE_SIZE;
+	u32 head = ACCESS_ONCE(ring->prod_head);
+	u32 off = head & (size - 1);
+	u32 total = FCHAR_RING_REC_SIZE(count);
+	u32 pad = (size - off < total) ? size - off : 0;
+
+	return pad + total <= size - (head - ACCESS_ONCE(ring->cons_tail));
+}
+
+/*
+ * read()/write() in ring mode: block (unless O_NONBLOCK) until a message or
+ * enough free space is available, then wake up the other side.
+ */
+static ssize_t fchar_ring_recv(struct file *filp, const struct iovec *iov,
+			       unsigned long nr_segs, size_t count)
+{
+	struct fchar_dev *dev = fchar_dev(filp);
+	ssize_t ret;
+
+	for (;;) {
+		ret = fchar_ring_read(dev, iov, nr_segs, count);
+		if (ret != -EAGAIN || (filp->f_flags & O_NONBLOCK))
+			break;
+		if (wait_event_interruptible(dev->wait,
+				!fchar_ring_empty(dev)))
+			return -ERESTARTSYS;
+	}
+	if (ret >= 0)
+		fchar_notify(dev);
+	return ret;
+}
+
+static ssize_t fchar_ring_send(struct file *filp, const struct iovec *iov,
+			       unsigned long nr_segs, size_t count)
+{
+	struct fchar_dev *dev = fchar_dev(filp);
+	ssize_t ret;
+
+	for (;;) {
+		ret = fchar_ring_write(dev, iov, nr_segs, count);
+		if (ret != -EAGAIN || (filp->f_flags & O_NONBLOCK))
+			break;
+		if (wait_event_interruptible(dev->wait,
+				fchar_ring_fits(dev, count)))
+			return -ERESTARTSYS;
+	}
+	if (ret >= 0)
+		fchar_notify(dev);
+	return ret;
+}
+
+/*
+ * Sharded mode: see the layout description in fchar.h.
+ *
+ * Writers only touch the shard of their CPU: they reserve the space moving
+ * its head forward with a cmpxchg() and commit the record setting its flags.
+ * FCHAR_IOCRESET waits for the writers and readers in flight through
+ * fchar_srcu, while the new ones wait for the reset to be completed. Like in
+ * ring mode, nothing read from the shards is trusted: positions and record
+ * sizes are checked against the data area before being used.
+ */
+struct fchar_shard_iter {
+	struct mutex lock;
+	loff_t pos;		/* position in the merged stream */
+	u32 gen;		/* shard_gen the offsets refer to */
+	int cur;		/* shard of the record being read, or -1 */
+	u32 total;		/* size of that record */
+	u32 skip;		/* bytes of that record already read */
+	u32 off[0];		/* next record of each shard */
+};
+
+static inline struct fchar_shard *fchar_shard(struct fchar_dev *dev,
+					      unsigned int i)
+{
+	return (struct fchar_shard *)(dev->data + i * dev->shard_size);
+}
+
+static inline void *fchar_shard_data(struct fchar_dev *dev, unsigned int i)
+{
+	return fchar_shard(dev, i) + 1;
+}
+
+static inline u32 fchar_shard_data_size(struct fchar_dev *dev)
+{
+	return dev->shard_size - sizeof(struct fchar_shard);
+}
+
+static void fchar_shard_init(struct fchar_dev *dev)
+{
+	struct fchar_shard *shard;
+	unsigned int i;
+
+	BUILD_BUG_ON(sizeof(*shard) > PAGE_SIZE);
+
+	for (i = 0; i < dev->nr_shards; i++) {
+		shard = fchar_shard(dev, i);
+		shard->magic = FCHAR_SHARD_MAGIC;
+		shard->version = FCHAR_SHARD_VERSION;
+		shard->nr_shards = dev->nr_shards;
+		shard->shard_size = dev->shard_size;
+		shard->data_offset = sizeof(*shard);
+		shard->size = fchar_shard_data_size(dev);
+		shard->cpu = i;
+		shard->head = 0;
+	}
+}
+
+/* Enter a section waited for by FCHAR_IOCRESET, return the SRCU index */
+static int fchar_shard_enter(struct fchar_dev *dev)
+{
+	int idx;
+
+	for (;;) {
+		idx = srcu_read_lock(&fchar_srcu);
+		if (likely(!ACCESS_ONCE(dev->resetting)))
+			return idx;
+		srcu_read_unlock(&fchar_srcu, idx);
+		wait_event(dev->reset_wait, !ACCESS_ONCE(dev->resetting));
+	}
+}
+
+/* Append the (gathered) iovec as a single record */
+static ssize_t fchar_shard_append(struct fchar_dev *dev,
+				  const struct iovec *iov, unsigned long nr_segs,
+				  size_t count)
+{
+	u32 size = fchar_shard_data_size(dev);
+	struct fchar_shard_rec *rec;
+	struct fchar_shard *shard;
+	u32 head, total;
+	int cpu, idx, ret;
+
+	if (count > size - sizeof(*rec))
+		return -EMSGSIZE;
+	if (!count)
+		return 0;
+	total = FCHAR_SHARD_REC_SIZE(count);
+
+	idx = fchar_shard_enter(dev);
+	/* Being moved to another CPU from now on is harmless, only slower */
+	cpu = raw_smp_processor_id();
+	shard = fchar_shard(dev, cpu);
+	do {
+		head = ACCESS_ONCE(shard->head);
+		if (head > size || total > size - head) {
+			srcu_read_unlock(&fchar_srcu, idx);
+			return -ENOSPC;
+		}
+	} while (cmpxchg(&shard->head, head, head + total) != head);
+
+	rec = fchar_shard_data(dev, cpu) + head;
+	rec->ts = local_clock();
+	rec->len = count;
+	rec->cpu = cpu;
+	ret = fchar_copy_from_iovec(rec + 1, iov, nr_segs, count);
+	smp_wmb();
+	ACCESS_ONCE(rec->flags) = ret ?
+		FCHAR_SHARD_REC_COMMIT | FCHAR_SHARD_REC_PAD :
+		FCHAR_SHARD_REC_COMMIT;
+	srcu_read_unlock(&fchar_srcu, idx);
+
+	return ret ? ret : count;
+}
+
+/*
+ * Return the next complete record of shard i, skipping the padding ones,
+ * and store its size in total.
+ */
+static struct fchar_shard_rec *fchar_shard_peek(struct fchar_dev *dev,
+						unsigned int i, u32 *off,
+						u32 *total)
+{
+	u32 size = fchar_shard_data_size(dev);
+	u32 head = min(ACCESS_ONCE(fchar_shard(dev, i)->head), size);
+	struct fchar_shard_rec *rec;
+	u32 len;
+	u16 flags;
+
+	while (*off < head && head - *off >= sizeof(*rec)) {
+		rec = fchar_shard_data(dev, i) + *off;
+		flags = ACCESS_ONCE(rec->flags);
+		if (!(flags & FCHAR_SHARD_REC_COMMIT))
+			break;
+		/* Pairs with the smp_wmb() in fchar_shard_append() */
+		smp_rmb();
+		len = ACCESS_ONCE(rec->len);
+		if (len > size || FCHAR_SHARD_REC_SIZE(len) > head - *off)
+			break;
+		*total = FCHAR_SHARD_REC_SIZE(len);
+		if (!(flags & FCHAR_SHARD_REC_PAD))
+			return rec;
+		*off += *total;
+	}
+	return NULL;
+}
+
+/* Pick the shard with the oldest next record, -1 if there is none */
+static int fchar_shard_next(struct fchar_dev *dev, struct fchar_shard_iter *it)
+{
+	struct fchar_shard_rec *rec;
+	u64 ts, oldest = 0;
+	int i, best = -1;
+	u32 total;
+
+	for (i = 0; i < dev->nr_shards; i++) {
+		rec = fchar_shard_peek(dev, i, &it->off[i], &total);
+		if (!rec)
+			continue;
+		ts = ACCESS_ONCE(rec->ts);
+		if (best < 0 || ts < oldest) {
+			best = i;
+			oldest = ts;
+			it->total = total;
+		}
+	}
+	return best;
+}
+
+static void fchar_shard_rewind(struct fchar_dev *dev,
+			       struct fchar_shard_iter *it)
+{
+	memset(it->off, 0, dev->nr_shards * sizeof(it->off[0]));
+	it->pos = 0;
+	it->gen = dev->shard_gen;
+	it->cur = -1;
+}
+
+static struct fchar_shard_iter *fchar_shard_iter_alloc(struct fchar_dev *dev)
+{
+	struct fchar_shard_iter *it;
+
+	it = kmalloc(sizeof(*it) + dev->nr_shards * sizeof(it->off[0]),
+		     GFP_KERNEL);
+	if (unlikely(!it))
+		return NULL;
+	mutex_init(&it->lock);
+	fchar_shard_rewind(dev, it);
+	return it;
+}
+
+/*
+ * read() in sharded mode: the merged stream is generated on the fly, the
+ * file remembers where it stopped in each shard. Seeking backwards replays
+ * the merge from the start.
+ */
+static ssize_t fchar_shard_read(struct file *filp, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct fchar_file *ff = filp->private_data;
+	struct fchar_shard_iter *it = ff->iter;
+	struct fchar_dev *dev = ff->dev;
+	ssize_t read = 0;
+	size_t chunk;
+	void *rec;
+	int idx;
+
+	if (mutex_lock_interruptible(&it->lock))
+		return -ERESTARTSYS;
+	idx = fchar_shard_enter(dev);
+	if (it->gen != dev->shard_gen || *ppos < it->pos)
+		fchar_shard_rewind(dev, it);
+	while (read < count) {
+		if (it->cur < 0) {
+			it->cur = fchar_shard_next(dev, it);
+			if (it->cur < 0)
+				break;
+			it->skip = 0;
+		}
+		rec = fchar_shard_data(dev, it->cur) + it->off[it->cur];
+		chunk = min_t(size_t, it->total - it->skip, count - read);
+		if (it->pos < *ppos) {
+			/* Seeking forward */
+			chunk = min_t(loff_t, chunk, *ppos - it->pos);
+		} else {
+			if (copy_to_user(buf + read, rec + it->skip, chunk)) {
+				if (!read)
+					read = -EFAULT;
+				break;
+			}
+			read += chunk;
+		}
+		it->pos += chunk;
+		it->skip += chunk;
+		if (it->skip == it->total) {
+			it->off[it->cur] += it->total;
+			it->cur = -1;
+			cond_resched();
+		}
+	}
+	srcu_read_unlock(&fchar_srcu, idx);
+	mutex_unlock(&it->lock);
+
+	if (read > 0)
+		*ppos += read;
+	return read;
+}
+
+static long fchar_shard_reset(struct fchar_dev *dev)
+{
+	struct fchar_shard *shard;
+	unsigned int i;
+
+	if (!(dev->flags & FCHAR_F_SHARDED))
+		return -EINVAL;
+
+	mutex_lock(&dev->lock);
+	ACCESS_ONCE(dev->resetting) = true;
+	synchronize_srcu(&fchar_srcu);
+	for (i = 0; i < dev->nr_shards; i++) {
+		shard = fchar_shard(dev, i);
+		memset(fchar_shard_data(dev, i), 0,
+		       min(ACCESS_ONCE(shard->head), fchar_shard_data_size(dev)));
+		shard->head = 0;
+	}
+	dev->shard_gen++;
+	smp_wmb();
+	ACCESS_ONCE(dev->resetting) = false;
+	wake_up_all(&dev->reset_wait);
+	mutex_unlock(&dev->lock);
+
+	return 0;
+}
+
+/*
+ * Access heat, built in with "make FCHAR_HEAT=y": every CPU counts the
+ * read()s, write()s (splice and batches included) and page faults that
+ * touch each page of a plain or huge device. The counters are summed in
+ * debugfs, fchar/<minor>/heat, that shows a map of the device and its
+ * hottest pages; writing to fchar/<minor>/reset starts a new window.
+ *
+ * Without FCHAR_HEAT, fchar_heat() is an empty inline and the access paths
+ * are the same as before.
+ */
+enum {
+	FCHAR_HEAT_READ,
+	FCHAR_HEAT_WRITE,
+	FCHAR_HEAT_FAULT,
+	FCHAR_HEAT_NR,
+};
+
+#ifdef FCHAR_HEAT
+struct fchar_heat {
+	u32 count[FCHAR_HEAT_NR];
+};
+
+#define FCHAR_HEAT_COLS		64
+#define FCHAR_HEAT_ROWS		16
+#define FCHAR_HEAT_TOP		16
+
+/* A hottest page, for the top list of fchar_heat_show() */
+struct fchar_heat_page {
+	pgoff_t index;
+	u64 count[FCHAR_HEAT_NR];
+	u64 total;
+};
+
+struct fchar_heat_stats {
+	u64 total[FCHAR_HEAT_NR];
+	u64 cell[FCHAR_HEAT_ROWS * FCHAR_HEAT_COLS];
+	struct fchar_heat_page top[FCHAR_HEAT_TOP];
+	unsigned int nr_top;
+};
+
+/* From cold to hot, on a log scale */
+static const char fchar_heat_levels[] = " .:-=+*#%@";
+
+static struct dentry *fchar_debugfs;
+
+/* Account an access of type @type to the pages of [pos, pos + len) */
+static inline void fchar_heat(struct fchar_dev *dev, int type, loff_t pos,
+			      size_t len)
+{
+	struct fchar_heat *heat;
+	pgoff_t index, last;
+
+	if (!dev->heat || !len)
+		return;
+	last = (pos + len - 1) >> PAGE_SHIFT;
+	heat = dev->heat[get_cpu()];
+	for (index = pos >> PAGE_SHIFT; index <= last; index++)
+		heat[index].count[type]++;
+	put_cpu();
+}
+
+static void fchar_heat_free(struct fchar_dev *dev)
+{
+	int cpu;
+
+	if (!dev->heat)
+		return;
+	for_each_possible_cpu(cpu)
+		vfree(dev->heat[cpu]);
+	kfree(dev->heat);
+	dev->heat = NULL;
+}
+
+/*
+ * Only the shared devices are instrumented, and a device that can't get its
+ * counters just works without them.
+ */
+static void fchar_heat_alloc(struct fchar_dev *dev)
+{
+	size_t size = (dev->max_size >> PAGE_SHIFT) * sizeof(**dev->heat);
+	int cpu;
+
+	if (dev->private || (dev->flags & FCHAR_F_RECORDS))
+		return;
+	dev->heat = kcalloc(nr_cpu_ids, sizeof(*dev->heat), GFP_KERNEL);
+	if (unlikely(!dev->heat))
+		goto error;
+	for_each_possible_cpu(cpu) {
+		dev->heat[cpu] = vzalloc_node(size, cpu_to_node(cpu));
+		if (unlikely(!dev->heat[cpu]))
+			goto error;
+	}
+	return;
+error:
+	fchar_heat_free(dev);
+	printk(KERN_WARNING "fchar: minor %d: no memory for the heat "
+			"counters\n", dev->minor);
+}
+
+static void fchar_heat_sum(struct fchar_dev *dev, pgoff_t index,
+			   struct fchar_heat_page *hp)
+{
+	int cpu, i;
+
+	memset(hp, 0, sizeof(*hp));
+	hp->index = index;
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < FCHAR_HEAT_NR; i++)
+			hp->count[i] += dev->heat[cpu][index].count[i];
+	for (i = 0; i < FCHAR_HEAT_NR; i++)
+		hp->total += hp->count[i];
+}
+
+/* Keep the FCHAR_HEAT_TOP hottest pages, sorted by decreasing total */
+static void fchar_heat_rank(struct fchar_heat_stats *st,
+			    const struct fchar_heat_page *hp)
+{
+	unsigned int i = st->nr_top;
+
+	if (!hp->total)
+		return;
+	if (i == FCHAR_HEAT_TOP) {
+		if (hp->total <= st->top[i - 1].total)
+			return;
+		i--;
+	} else {
+		st->nr_top++;
+	}
+	for (; i && st->top[i - 1].total < hp->total; i--)
+		st->top[i] = st->top[i - 1];
+	st->top[i] = *hp;
+}
+
+static char fchar_heat_level(u64 count, u64 max)
+{
+	int levels = sizeof(fchar_heat_levels) - 1;
+	int bits = fls64(max);
+
+	if (!count)
+		return fchar_heat_levels[0];
+	if (bits == 1)
+		return fchar_heat_levels[levels - 1];
+	return fchar_heat_levels[1 + (fls64(count) - 1) * (levels - 2) /
+				 (bits - 1)];
+}
+
+static int fchar_heat_show(struct seq_file *m, void *v)
+{
+	struct fchar_dev *dev = m->private;
+	struct fchar_heat_stats *st;
+	struct fchar_heat_page hp;
+	pgoff_t index, nr_pages, per_cell, nr_cells;
+	unsigned int i;
+	u64 hottest = 0;
+
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+	mutex_lock(&dev->lock);
+	if (!dev->heat) {
+		seq_puts(m, "not instrumented (not opened yet?)\n");
+		goto out;
+	}
+	nr_pages = dev->size >> PAGE_SHIFT;
+	per_cell = DIV_ROUND_UP(nr_pages, FCHAR_HEAT_ROWS * FCHAR_HEAT_COLS);
+	nr_cells = DIV_ROUND_UP(nr_pages, per_cell);
+	for (index = 0; index < nr_pages; index++) {
+		fchar_heat_sum(dev, index, &hp);
+		for (i = 0; i < FCHAR_HEAT_NR; i++)
+			st->total[i] += hp.count[i];
+		st->cell[index / per_cell] += hp.total;
+		fchar_heat_rank(st, &hp);
+		cond_resched();
+	}
+	for (i = 0; i < nr_cells; i++)
+		hottest = max(hottest, st->cell[i]);
+
+	seq_printf(m, "pages %lu, %lu per cell\n", nr_pages, per_cell);
+	seq_printf(m, "reads %llu writes %llu faults %llu\n\n",
+		   st->total[FCHAR_HEAT_READ], st->total[FCHAR_HEAT_WRITE],
+		   st->total[FCHAR_HEAT_FAULT]);
+	for (i = 0; i < nr_cells; i++) {
+		if (!(i % FCHAR_HEAT_COLS))
+			seq_printf(m, "%12llx |",
+				   (u64)i * per_cell << PAGE_SHIFT);
+		seq_putc(m, fchar_heat_level(st->cell[i], hottest));
+		if (i % FCHAR_HEAT_COLS == FCHAR_HEAT_COLS - 1 ||
+				i == nr_cells - 1)
+			seq_puts(m, "|\n");
+	}
+	seq_printf(m, "\n%12s %12s %12s %12s %12s\n",
+		   "page", "offset", "reads", "writes", "faults");
+	for (i = 0; i < st->nr_top; i++)
+		seq_printf(m, "%12lu %12llx %12llu %12llu %12llu\n",
+			   st->top[i].index,
+			   (u64)st->top[i].index << PAGE_SHIFT,
+			   st->top[i].count[FCHAR_HEAT_READ],
+			   st->top[i].count[FCHAR_HEAT_WRITE],
+			   st->top[i].count[FCHAR_HEAT_FAULT]);
+out:
+	mutex_unlock(&dev->lock);
+	kfree(st);
+	return 0;
+}
+
+static int fchar_heat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fchar_heat_show, inode->i_private);
+}
+
+static const struct file_operations fchar_heat_fops = {
+	.open		= fchar_heat_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.owner		= THIS_MODULE,
+};
+
+/* Any write zeroes the counters */
+static ssize_t fchar_heat_reset(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct fchar_dev *dev = file->private_data;
+	int cpu;
+
+	mutex_lock(&dev->lock);
+	if (dev->heat)
+		for_each_possible_cpu(cpu)
+			memset(dev->heat[cpu], 0, (dev->max_size >> PAGE_SHIFT) *
+			       sizeof(**dev->heat));
+	mutex_unlock(&dev->lock);
+
+	return count;
+}
+
+static const struct file_operations fchar_heat_reset_fops = {
+	.open		= simple_open,
+	.write		= fchar_heat_reset,
+	.llseek		= noop_llseek,
+	.owner		= THIS_MODULE,
+};
+
+/* Instrumentation isn't worth failing the module load for */
+static void fchar_heat_init(void)
+{
+	struct dentry *dir;
+	char name[16];
+	int i;
+
+	fchar_debugfs = debugfs_create_dir("fchar", NULL);
+	if (IS_ERR_OR_NULL(fchar_debugfs)) {
+		fchar_debugfs = NULL;
+		return;
+	}
+	for (i = 0; i < fchar_nr; i++) {
+		snprintf(name, sizeof(name), "%d", i);
+		dir = debugfs_create_dir(name, fchar_debugfs);
+		if (!dir)
+			continue;
+		debugfs_create_file("heat", 0444, dir, &fchar_devs[i],
+				    &fchar_heat_fops);
+		debugfs_create_file("reset", 0200, dir, &fchar_devs[i],
+				    &fchar_heat_reset_fops);
+	}
+}
+
+static void fchar_heat_exit(void)
+{
+	debugfs_remove_recursive(fchar_debugfs);
+}
+#else
+static inline void fchar_heat(struct fchar_dev *dev, int type, loff_t pos,
+			      size_t len)
+{
+}
+
+static inline void fchar_heat_alloc(struct fchar_dev *dev)
+{
+}
+
+static inline void fchar_heat_free(struct fchar_dev *dev)
+{
+}
+
+static inline void fchar_heat_init(void)
+{
+}
+
+static inline void fchar_heat_exit(void)
+{
+}
+#endif /* FCHAR_HEAT */
+
+static inline bool fchar_allocated(struct fchar_dev *dev)
+{
+	return dev->data || dev->pages;
+}
+
+static void fchar_free_backing(struct fchar_dev *dev)
+{
+	if (dev->flags & FCHAR_F_HUGE)
+		free_huge_data(dev);
+	else if (dev->flags & (FCHAR_F_RING | FCHAR_F_SHARDED))
+		free_data(dev->data, dev->size);
+	else
+		free_sparse_data(dev);
+	dev->data = NULL;
+}
+
+/* The backing file is opened with the first open of the device */
+static int fchar_store_open(struct fchar_dev *dev)
+{
+	struct file *filp;
+
+	dev->dirty = vzalloc(BITS_TO_LONGS(dev->max_size >> PAGE_SHIFT) *
+			     sizeof(long));
+	if (unlikely(!dev->dirty))
+		return -ENOMEM;
+	filp = filp_open(dev->store_path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(filp)) {
+		printk(KERN_ERR "fchar: minor %d: can't open %s (%ld)\n",
+				dev->minor, dev->store_path, PTR_ERR(filp));
+		vfree(dev->dirty);
+		dev->dirty = NULL;
+		return PTR_ERR(filp);
+	}
+	dev->store = filp;
+	return 0;
+}
+
+static void fchar_store_close(struct fchar_dev *dev)
+{
+	int ret;
+
+	if (!dev->store)
+		return;
+	ret = fchar_flush(dev);
+	if (ret)
+		printk(KERN_ERR "fchar: minor %d: can't write back to %s "
+				"(%d), changes lost\n",
+				dev->minor, dev->store_path, ret);
+	filp_close(dev->store, NULL);
+	dev->store = NULL;
+	vfree(dev->dirty);
+	dev->dirty = NULL;
+}
+
+static int fchar_alloc_dev_data(struct fchar_dev *dev, int node)
+{
+	int ret;
+
+	dev->node = node;
+	if (dev->flags & FCHAR_F_HUGE)
+		dev->data = alloc_huge_data(dev, node);
+	else if (dev->flags & (FCHAR_F_RING | FCHAR_F_SHARDED))
+		dev->data = alloc_data(dev->size, node);
+	else
+		dev->pages = alloc_sparse_data(dev->max_size, node);
+	if (unlikely(!fchar_allocated(dev)))
+		return -ENOMEM;
+	if (dev->flags & FCHAR_F_RING) {
+		fchar_ring_init(dev);
+		return 0;
+	}
+	if (dev->flags & FCHAR_F_SHARDED) {
+		fchar_shard_init(dev);
+		return 0;
+	}
+	dev->seq = vzalloc_node((dev->max_size >> PAGE_SHIFT) *
+				sizeof(*dev->seq), node);
+	if (unlikely(!dev->seq)) {
+		fchar_free_backing(dev);
+		return -ENOMEM;
+	}
+	if (dev->store_path) {
+		ret = fchar_store_open(dev);
+		if (unlikely(ret)) {
+			vfree(dev->seq);
+			dev->seq = NULL;
+			fchar_free_backing(dev);
+			return ret;
+		}
+	}
+	fchar_heat_alloc(dev);
+	return 0;
+}
+
+static void fchar_free_dev_data(struct fchar_dev *dev)
+{
+	fchar_store_close(dev);
+	fchar_heat_free(dev);
+	hrtimer_cancel(&dev->wake_timer);
+	vfree(dev->seq);
+	dev->seq = NULL;
+	fchar_free_backing(dev);
+	if (dev->inode) {
+		iput(dev->inode);
+		dev->inode = NULL;
+	}
+}
+
+static inline int fchar_nr_minors(void)
+{
+	/* Shared devices plus the private one */
+	return fchar_nr + 1;
+}
+
+static void fchar_init_dev(struct fchar_dev *dev, int minor)
+{
+	dev->minor = minor;
+	dev->node = NUMA_NO_NODE;
+	mutex_init(&dev->lock);
+	spin_lock_init(&dev->range_lock);
+	INIT_LIST_HEAD(&dev->ranges);
+	init_waitqueue_head(&dev->range_wait);
+	init_waitqueue_head(&dev->reset_wait);
+	init_waitqueue_head(&dev->wait);
+	atomic_set(&dev->gen, 0);
+	hrtimer_init(&dev->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->wake_timer.function = fchar_wake_timer;
+}
+
+static struct fchar_dev *fchar_open_private(void)
+{
+	struct fchar_dev *dev;
+	int node = numa_node_id();
+	int ret;
+
+	dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+	if (unlikely(!dev))
+		return ERR_PTR(-ENOMEM);
+	fchar_init_dev(dev, fchar_nr);
+	dev->private = true;
+	dev->size = PAGE_ALIGN(fchar_size);
+	dev->max_size = max_t(size_t, dev->size, PAGE_ALIGN(fchar_max_size));
+
+	ret = fchar_alloc_dev_data(dev, node);
+	if (unlikely(ret)) {
+		kfree(dev);
+		return ERR_PTR(ret);
+	}
+	return dev;
+}
+
+static struct fchar_dev *fchar_open_shared(unsigned int minor)
+{
+	struct fchar_dev *dev = &fchar_devs[minor];
+	int ret = 0;
+
+	/*
+	 * Allocate the buffer on first use, so that it is placed on the memory
+	 * node of the CPU that opened it.
+	 */
+	mutex_lock(&dev->lock);
+	if (!fchar_allocated(dev))
+		ret = fchar_alloc_dev_data(dev, numa_node_id());
+	mutex_unlock(&dev->lock);
+
+	return ret ? ERR_PTR(ret) : dev;
+}
+
+static int fchar_open(struct inode *inode, struct file *filp)
+{
+	unsigned int minor = iminor(inode);
+	struct fchar_file *ff;
+	int ret;
+
+	fchar_trace("%s(%u)\n", __func__, minor);
+
+	if (unlikely(minor > fchar_nr))
+		return -ENODEV;
+	ff = kzalloc(sizeof(*ff), GFP_KERNEL);
+	if (unlikely(!ff))
+		return -ENOMEM;
+
+	if (minor == fchar_nr)
+		ff->dev = fchar_open_private();
+	else
+		ff->dev = fchar_open_shared(minor);
+	if (IS_ERR(ff->dev)) {
+		ret = PTR_ERR(ff->dev);
+		kfree(ff);
+		return ret;
+	}
+	/*
+	 * Share one address space among all the files of a device (even when
+	 * opened through different nodes), so that fchar_resize() can find
+	 * all its mappings.
+	 */
+	mutex_lock(&ff->dev->lock);
+	if (!ff->dev->inode) {
+		ihold(inode);
+		ff->dev->inode = inode;
+	}
+	mutex_unlock(&ff->dev->lock);
+	filp->f_mapping = ff->dev->inode->i_mapping;
+	if (ff->dev->flags & FCHAR_F_SHARDED) {
+		ff->iter = fchar_shard_iter_alloc(ff->dev);
+		if (unlikely(!ff->iter)) {
+			kfree(ff);
+			return -ENOMEM;
+		}
+	}
+	ff->seen = atomic_read(&ff->dev->gen);
+	filp->private_data = ff;
+
+	return 0;
+}
+
+static int fchar_release(struct inode *inode, struct file *filp)
+{
+	struct fchar_file *ff = filp->private_data;
+	struct fchar_dev *dev = ff->dev;
+
+	fchar_trace("%s(%d)\n", __func__, dev->minor);
+
+	if (ff->queue)
+		fchar_queue_destroy(ff->queue);
+	/*
+	 * Any mapping of the buffer holds a reference to the file, so there
+	 * can't be any user left when a private device is released.
+	 */
+	if (dev->private) {
+		fchar_free_dev_data(dev);
+		kfree(dev);
+	}
+	kfree(ff->iter);
+	kfree(ff);
+
+	return 0;
+}
+
+/*
+ * Page-range consistency.
+ *
+ * Each page of the buffer has a sequence counter, odd while a writer is
+ * updating it. Writers lock the range of pages they touch (writers of
+ * disjoint ranges run concurrently), make their counters odd, copy and make
+ * them even again. Readers don't lock anything: they sample the counters of
+ * their range, copy and retry if any of them changed in the meantime, so
+ * each read() returns a snapshot that no write() was in the middle of.
+ *
+ * A reader that keeps losing against the writers falls back to locking the
+ * range like a writer does, to guarantee forward progress.
+ *
+ * NOTE: stores done through mmap() and the pages referenced by splice_read()
+ * bypass all of this.
+ */
+#define FCHAR_READ_RETRIES	8
+#define FCHAR_READ_SNAP_PAGES	32
+
+struct fchar_range {
+	unsigned long first, last;	/* page indexes, inclusive */
+	struct list_head list;
+};
+
+static bool fchar_range_trylock(struct fchar_dev *dev, struct fchar_range *r)
+{
+	struct fchar_range *o;
+
+	spin_lock(&dev->range_lock);
+	list_for_each_entry(o, &dev->ranges, list)
+		if (r->first <= o->last && o->first <= r->last) {
+			spin_unlock(&dev->range_lock);
+			return false;
+		}
+	list_add(&r->list, &dev->ranges);
+	spin_unlock(&dev->range_lock);
+
+	return true;
+}
+
+static void fchar_range_lock(struct fchar_dev *dev, struct fchar_range *r,
+			     loff_t pos, size_t count)
+{
+	r->first = pos >> PAGE_SHIFT;
+	r->last = (pos + count - 1) >> PAGE_SHIFT;
+	wait_event(dev->range_wait, fchar_range_trylock(dev, r));
+}
+
+static void fchar_range_unlock(struct fchar_dev *dev, struct fchar_range *r)
+{
+	spin_lock(&dev->range_lock);
+	list_del(&r->list);
+	spin_unlock(&dev->range_lock);
+	smp_mb();
+	if (waitqueue_active(&dev->range_wait))
+		wake_up_all(&dev->range_wait);
+}
+
+static void fchar_write_begin(struct fchar_dev *dev, struct fchar_range *r)
+{
+	unsigned long i;
+
+	for (i = r->first; i <= r->last; i++) {
+		dev->seq[i]++;
+		if (dev->dirty && !test_bit(i, dev->dirty))
+			set_bit(i, dev->dirty);
+	}
+	smp_wmb();
+}
+
+static void fchar_write_end(struct fchar_dev *dev, struct fchar_range *r)
+{
+	unsigned long i;
+
+	smp_wmb();
+	for (i = r->first; i <= r->last; i++)
+		dev->seq[i]++;
+}
+
+/* Sample the counters of a range; false if a writer is in the middle of it */
+static bool fchar_read_begin(struct fchar_dev *dev, struct fchar_range *r,
+			     unsigned int *snap)
+{
+	unsigned long i;
+
+	for (i = r->first; i <= r->last; i++) {
+		snap[i - r->first] = ACCESS_ONCE(dev->seq[i]);
+		if (snap[i - r->first] & 1)
+			return false;
+	}
+	smp_rmb();
+	return true;
+}
+
+static bool fchar_read_retry(struct fchar_dev *dev, struct fchar_range *r,
+			     const unsigned int *snap)
+{
+	unsigned long i;
+
+	smp_rmb();
+	for (i = r->first; i <= r->last; i++)
+		if (ACCESS_ONCE(dev->seq[i]) != snap[i - r->first])
+			return true;
+	return false;
+}
+
+/* Copy out of the buffer, in page-sized chunks, return the copied bytes */
+static ssize_t __fchar_copy_out(struct fchar_dev *dev, char __user *buf,
+				size_t count, loff_t p)
+{
+	ssize_t chunk, read = 0;
+
+	while (count > 0) {
+		ssize_t copied;
+		void *addr;
+
+		chunk = size_inside_page(p, count);
+		addr = fchar_addr(dev, p, false);
+		if (IS_ERR(addr))
+			return read ? read : PTR_ERR(addr);
+		if (addr)
+			copied = copy_to_user(buf, addr, chunk);
+		else
+			copied = clear_user(buf, chunk);
+		read += chunk - copied;
+		if (copied)
+			break;
+		if (signal_pending(current))
+			return read ? read : -ERESTARTSYS;
+		buf += chunk;
+		p += chunk;
+		count -= chunk;
+
+		cond_resched();
+	}
+	return read;
+}
+
+static ssize_t __fchar_copy_in(struct fchar_dev *dev, const char __user *buf,
+			       size_t count, loff_t p)
+{
+	ssize_t chunk, written = 0;
+
+	while (count > 0) {
+		ssize_t copied;
+		void *addr;
+
+		chunk = size_inside_page(p, count);
+		addr = fchar_addr(dev, p, true);
+		if (IS_ERR(addr))
+			return written ? written : PTR_ERR(addr);
+		copied = copy_from_user(addr, buf, chunk);
+		written += chunk - copied;
+		if (copied)
+			break;
+		if (signal_pending(current))
+			return written ? written : -ERESTARTSYS;
+		buf += chunk;
+		p += chunk;
+		count -= chunk;
+
+		cond_resched();
+	}
+	return written;
+}
+
+static ssize_t fchar_do_read(struct fchar_dev *dev, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	unsigned int stack_snap[FCHAR_READ_SNAP_PAGES], *snap = stack_snap;
+	struct fchar_range range;
+	unsigned long nr_pages;
+	loff_t p = *ppos;
+	ssize_t read = 0;
+	size_t size;
+	int retry, idx;
+
+	fchar_trace("%s(%zd, %lld)\n", __func__, count, *ppos);
+	idx = srcu_read_lock(&fchar_srcu);
+	size = fchar_dev_size(dev);
+	if (p >= size || !count)
+		goto unlock;
+	count = min_t(size_t, count, size - p);
+
+	range.first = p >> PAGE_SHIFT;
+	range.last = (p + count - 1) >> PAGE_SHIFT;
+	nr_pages = range.last - range.first + 1;
+	if (nr_pages > FCHAR_READ_SNAP_PAGES)
+		snap = kmalloc(nr_pages * sizeof(*snap),
+				GFP_KERNEL | __GFP_NOWARN);
+
+	for (retry = 0; snap && retry < FCHAR_READ_RETRIES; retry++) {
+		if (!fchar_read_begin(dev, &range, snap)) {
+			cond_resched();
+			continue;
+		}
+		read = __fchar_copy_out(dev, buf, count, p);
+		if (!fchar_read_retry(dev, &range, snap))
+			goto out;
+		if (read == -ERESTARTSYS)
+			goto out;
+	}
+	/* Too much contention (or no memory for the snapshot): lock the range */
+	fchar_range_lock(dev, &range, p, count);
+	read = __fchar_copy_out(dev, buf, count, p);
+	fchar_range_unlock(dev, &range);
+out:
+	if (snap != stack_snap)
+		kfree(snap);
+	if (read > 0) {
+		fchar_heat(dev, FCHAR_HEAT_READ, p, read);
+		*ppos += read;
+	}
+unlock:
+	srcu_read_unlock(&fchar_srcu, idx);
+	return read;
+}
+
+static ssize_t fchar_do_write(struct fchar_dev *dev, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct fchar_range range;
+	loff_t p = *ppos;
+	ssize_t written = 0;
+	size_t size;
+	int idx;
+
+	fchar_trace("%s(%zd, %lld)\n", __func__, count, *ppos);
+	idx = srcu_read_lock(&fchar_srcu);
+	size = fchar_dev_size(dev);
+	if (p >= size || !count)
+		goto unlock;
+	count = min_t(size_t, count, size - p);
+
+	fchar_range_lock(dev, &range, p, count);
+	fchar_write_begin(dev, &range);
+	written = __fchar_copy_in(dev, buf, count, p);
+	fchar_write_end(dev, &range);
+	fchar_range_unlock(dev, &range);
+
+	if (written > 0) {
+		fchar_heat(dev, FCHAR_HEAT_WRITE, p, written);
+		*ppos += written;
+	}
+unlock:
+	srcu_read_unlock(&fchar_srcu, idx);
+	return written;
+}
+
+/* Readers observe the current generation before copying the data */
+static inline void fchar_mark_seen(struct file *filp)
+{
+	struct fchar_file *ff = filp->private_data;
+
+	ff->seen = atomic_read(&ff->dev->gen);
+	smp_rmb();
+}
+
+static ssize_t fchar_read(struct file *filp, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct fchar_dev *dev = fchar_dev(filp);
+
+	if (!access_ok(VERIFY_WRITE, buf, count))
+		return -EFAULT;
+	if (dev->flags & FCHAR_F_RING) {
+		struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+		return fchar_ring_recv(filp, &iov, 1, count);
+	}
+	fchar_mark_seen(filp);
+	if (dev->flags & FCHAR_F_SHARDED)
+		return fchar_shard_read(filp, buf, count, ppos);
+	return fchar_do_read(dev, buf, count, ppos);
+}
+
+static ssize_t fchar_write(struct file *filp, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct fchar_dev *dev = fchar_dev(filp);
+	ssize_t ret;
+
+	if (!access_ok(VERIFY_READ, buf, count))
+		return -EFAULT;
+	if (dev->flags & FCHAR_F_RING) {
+		struct iovec iov = {
+			.iov_base = (void __user *)buf,
+			.iov_len = count,
+		};
+
+		return fchar_ring_send(filp, &iov, 1, count);
+	}
+	if (dev->flags & FCHAR_F_SHARDED) {
+		struct iovec iov = {
+			.iov_base = (void __user *)buf,
+			.iov_len = count,
+		};
+
+		ret = fchar_shard_append(dev, &iov, 1, count);
+	} else {
+		ret = fchar_do_write(dev, buf, count, ppos);
+	}
+	if (ret > 0)
+		fchar_notify(dev);
+	return ret;
+}
+
+/*
+ * Vectored and asynchronous I/O: readv()/writev() and io_submit() end up
+ * here with the whole iovec (already validated by the VFS), which is copied
+ * in a single pass. The request is always completed synchronously.
+ *
+ * In ring mode an iovec is gathered into (or scattered from) one message,
+ * in sharded mode it's appended as one record.
+ */
+static ssize_t fchar_aio_read(struct kiocb *iocb, const struct iovec *iov,
+			      unsigned long nr_segs, loff_t pos)
+{
+	struct fchar_dev *dev = fchar_dev(iocb->ki_filp);
+	unsigned long seg;
+	ssize_t ret, read = 0;
+
+	if (dev->flags & FCHAR_F_RING)
+		return fchar_ring_recv(iocb->ki_filp, iov, nr_segs,
+				iov_length(iov, nr_segs));
+
+	fchar_mark_seen(iocb->ki_filp);
+	for (seg = 0; seg < nr_segs; seg++) {
+		if (dev->flags & FCHAR_F_SHARDED)
+			ret = fchar_shard_read(iocb->ki_filp, iov[seg].iov_base,
+					iov[seg].iov_len, &pos);
+		else
+			ret = fchar_do_read(dev, iov[seg].iov_base,
+					iov[seg].iov_len, &pos);
+		if (ret < 0) {
+			if (!read)
+				read = ret;
+			break;
+		}
+		read += ret;
+		if (ret < iov[seg].iov_len)
+			break;
+	}
+	iocb->ki_pos = pos;
+
+	return read;
+}
+
+static ssize_t fchar_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			       unsigned long nr_segs, loff_t pos)
+{
+	struct fchar_dev *dev = fchar_dev(iocb->ki_filp);
+	unsigned long seg;
+	ssize_t ret, written = 0;
+
+	if (dev->flags & FCHAR_F_RING)
+		return fchar_ring_send(iocb->ki_filp, iov, nr_segs,
+				iov_length(iov, nr_segs));
+	if (dev->flags & FCHAR_F_SHARDED) {
+		written = fchar_shard_append(dev, iov, nr_segs,
+				iov_length(iov, nr_segs));
+		if (written > 0)
+			fchar_notify(dev);
+		return written;
+	}
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		ret = fchar_do_write(dev, iov[seg].iov_base,
+				iov[seg].iov_len, &pos);
+		if (ret < 0) {
+			if (!written)
+				written = ret;
+			break;
+		}
+		written += ret;
+		if (ret < iov[seg].iov_len)
+			break;
+	}
+	iocb->ki_pos = pos;
+	if (written > 0)
+		fchar_notify(dev);
+
+	return written;
+}
+
+/*
+ * splice() support: the device pages are handed to the pipe by reference, so
+ * moving data to a socket or a file doesn't need any copy to/from userspace.
+ *
+ * NOTE: like vmsplice(), the pipe holds references to the live buffer, so
+ * writes done before the pipe is drained are visible to the reader. Holes of
+ * sparse devices are spliced as the zero page, so they always read as zeroes.
+ */
+static int fchar_pipe_buf_steal(struct pipe_inode_info *pipe,
+				struct pipe_buffer *buf)
+{
+	/* The pages belong to the device: never give them away */
+	return 1;
+}
+
+static const struct pipe_buf_operations fchar_pipe_buf_ops = {
+	.can_merge	= 0,
+	.map		= generic_pipe_buf_map,
+	.unmap		= generic_pipe_buf_unmap,
+	.confirm	= generic_pipe_buf_confirm,
+	.release	= generic_pipe_buf_release,
+	.steal		= fchar_pipe_buf_steal,
+	.get		= generic_pipe_buf_get,
+};
+
+static void fchar_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+static ssize_t fchar_splice_read(struct file *in, loff_t *ppos,
+				 struct pipe_inode_info *pipe, size_t len,
+				 unsigned int flags)
+{
+	struct fchar_dev *dev = fchar_dev(in);
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages		= pages,
+		.partial	= partial,
+		.nr_pages_max	= PIPE_DEF_BUFFERS,
+		.flags		= flags,
+		.ops		= &fchar_pipe_buf_ops,
+		.spd_release	= fchar_spd_release,
+	};
+	loff_t pos = *ppos;
+	ssize_t ret;
+	size_t size;
+	int idx, err = 0;
+
+	if (dev->flags & FCHAR_F_RECORDS)
+		return -EINVAL;
+	fchar_trace("%s(%zd, %lld)\n", __func__, len, pos);
+	if (splice_grow_spd(pipe, &spd))
+		return -ENOMEM;
+	fchar_mark_seen(in);
+	/* The pipe holds its own references, we don't need SRCU after this */
+	idx = srcu_read_lock(&fchar_srcu);
+	size = fchar_dev_size(dev);
+	len = pos < size ? min_t(size_t, len, size - pos) : 0;
+	while (len && spd.nr_pages < spd.nr_pages_max) {
+		size_t chunk = size_inside_page(pos, len);
+		struct page *page;
+
+		if (!fchar_sparse(dev))
+			page = vmalloc_to_page(dev->data + pos);
+		else if (dev->store)
+			page = fchar_get_page(dev, pos >> PAGE_SHIFT);
+		else
+			page = fchar_lookup_page(dev, pos >> PAGE_SHIFT) ? :
+				ZERO_PAGE(0);
+		if (IS_ERR(page)) {
+			err = PTR_ERR(page);
+			break;
+		}
+		get_page(page);
+		spd.pages[spd.nr_pages] = page;
+		spd.partial[spd.nr_pages].offset = offset_in_page(pos);
+		spd.partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+		pos += chunk;
+		len -= chunk;
+	}
+	srcu_read_unlock(&fchar_srcu, idx);
+	ret = spd.nr_pages ? splice_to_pipe(pipe, &spd) : err;
+	if (ret > 0) {
+		fchar_heat(dev, FCHAR_HEAT_READ, *ppos, ret);
+		*ppos += ret;
+	}
+	splice_shrink_spd(&spd);
+
+	return ret;
+}
+
+static int fchar_pipe_to_dev(struct pipe_inode_info *pipe,
+			     struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct fchar_dev *dev = fchar_dev(sd->u.file);
+	unsigned int len = sd->len, done, chunk;
+	struct fchar_range range;
+	void *src, *dst;
+	size_t size;
+	int ret, idx;
+
+	ret = buf->ops->confirm(pipe, buf);
+	if (unlikely(ret))
+		return ret;
+	idx = srcu_read_lock(&fchar_srcu);
+	size = fchar_dev_size(dev);
+	if (sd->pos >= size) {
+		srcu_read_unlock(&fchar_srcu, idx);
+		return -ENOSPC;
+	}
+	if (sd->pos + len > size)
+		len = size - sd->pos;
+	/* Not an atomic mapping: we may sleep on the range or to fill holes */
+	src = buf->ops->map(pipe, buf, 0);
+	fchar_range_lock(dev, &range, sd->pos, len);
+	fchar_write_begin(dev, &range);
+	for (done = 0; done < len; done += chunk) {
+		chunk = size_inside_page(sd->pos + done, len - done);
+		dst = fchar_addr(dev, sd->pos + done, true);
+		if (IS_ERR(dst)) {
+			ret = PTR_ERR(dst);
+			break;
+		}
+		memcpy(dst, src + buf->offset + done, chunk);
+	}
+	fchar_write_end(dev, &range);
+	fchar_range_unlock(dev, &range);
+	buf->ops->unmap(pipe, buf, src);
+	srcu_read_unlock(&fchar_srcu, idx);
+	fchar_heat(dev, FCHAR_HEAT_WRITE, sd->pos, done);
+
+	return done ? done : ret;
+}
+
+static ssize_t fchar_splice_write(struct pipe_inode_info *pipe,
+				  struct file *out, loff_t *ppos, size_t len,
+				  unsigned int flags)
+{
+	struct fchar_dev *dev = fchar_dev(out);
+	ssize_t ret;
+
+	if (dev->flags & FCHAR_F_RECORDS)
+		return -EINVAL;
+
+	fchar_trace("%s(%zd, %lld)\n", __func__, len, *ppos);
+	ret = splice_from_pipe(pipe, out, ppos, len, flags, fchar_pipe_to_dev);
+	if (ret > 0)
+		fchar_notify(dev);
+	return ret;
+}
+
+/*
+ * Batched operations (FCHAR_IOCBATCH). Fill and copy run entirely in the
+ * kernel: a fill of zeroes doesn't allocate the holes of sparse devices and
+ * a copy from a hole to a hole is a no-op.
+ */
+static ssize_t fchar_fill(struct fchar_dev *dev, loff_t pos, size_t len,
+			  int c)
+{
+	struct fchar_range range;
+	size_t done, chunk;
+	ssize_t ret = 0;
+	void *addr;
+
+	if (!len)
+		return 0;
+	fchar_range_lock(dev, &range, pos, len);
+	fchar_write_begin(dev, &range);
+	for (done = 0; done < len; done += chunk) {
+		chunk = size_inside_page(pos + done, len - done);
+		addr = fchar_addr(dev, pos + done, c != 0);
+		if (IS_ERR(addr)) {
+			ret = PTR_ERR(addr);
+			break;
+		}
+		if (addr)
+			memset(addr, c, chunk);
+		cond_resched();
+	}
+	fchar_write_end(dev, &range);
+	fchar_range_unlock(dev, &range);
+	fchar_heat(dev, FCHAR_HEAT_WRITE, pos, done);
+
+	return done ? done : ret;
+}
+
+/* memmove() within the device, page by page on both sides */
+static ssize_t fchar_move(struct fchar_dev *dev, loff_t dst, loff_t src,
+			  size_t len)
+{
+	bool backward = dst > src && dst < src + len;
+	loff_t start = min(dst, src), d, s;
+	struct fchar_range range;
+	size_t left, chunk;
+	void *from, *to;
+	ssize_t ret = len;
+
+	if (!len || dst == src)
+		return len;
+	fchar_range_lock(dev, &range, start, max(dst, src) + len - start);
+	fchar_write_begin(dev, &range);
+	for (left = len; left; left -= chunk) {
+		if (backward) {
+			d = dst + left;
+			s = src + left;
+			chunk = min_t(size_t, left,
+				min(offset_in_page(d - 1), offset_in_page(s - 1))
+				+ 1);
+			d -= chunk;
+			s -= chunk;
+		} else {
+			d = dst + len - left;
+			s = src + len - left;
+			chunk = min(size_inside_page(d, left),
+				    size_inside_page(s, left));
+		}
+		from = fchar_addr(dev, s, false);
+		to = IS_ERR(from) ? from : fchar_addr(dev, d, from != NULL);
+		if (IS_ERR(to)) {
+			ret = PTR_ERR(to);
+			break;
+		}
+		if (from)
+			memmove(to, from, chunk);
+		else if (to)
+			memset(to, 0, chunk);
+		cond_resched();
+	}
+	fchar_write_end(dev, &range);
+	fchar_range_unlock(dev, &range);
+	if (ret > 0) {
+		fchar_heat(dev, FCHAR_HEAT_READ, src, len);
+		fchar_heat(dev, FCHAR_HEAT_WRITE, dst, len);
+	}
+
+	return ret;
+}
+
+/* Must be called within fchar_srcu, like the operation on the range */
+static inline bool fchar_valid_range(struct fchar_dev *dev, u64 off, u64 len)
+{
+	size_t size = fchar_dev_size(dev);
+
+	return len <= size && off <= size - len;
+}
+
+static ssize_t __fchar_exec_op(struct fchar_dev *dev, const struct fchar_op *op)
+{
+	loff_t pos = op->offset;
+
+	if (!fchar_valid_range(dev, op->offset, op->len))
+		return -EINVAL;
+
+	switch (op->opcode) {
+	case FCHAR_OP_FILL:
+		return fchar_fill(dev, pos, op->len, op->value & 0xff);
+	case FCHAR_OP_COPY:
+		if (!fchar_valid_range(dev, op->src, op->len))
+			return -EINVAL;
+		return fchar_move(dev, pos, op->src, op->len);
+	case FCHAR_OP_WRITE:
+		return fchar_do_write(dev,
+				(const char __user *)(unsigned long)op->addr,
+				op->len, &pos);
+	case FCHAR_OP_READ:
+		return fchar_do_read(dev, (char __user *)(unsigned long)op->addr,
+				op->len, &pos);
+	}
+	return -EINVAL;
+}
+
+static ssize_t fchar_exec_op(struct fchar_dev *dev, const struct fchar_op *op)
+{
+	ssize_t ret;
+	int idx;
+
+	idx = srcu_read_lock(&fchar_srcu);
+	ret = __fchar_exec_op(dev, op);
+	srcu_read_unlock(&fchar_srcu, idx);
+
+	return ret;
+}
+
+static long fchar_batch(struct file *filp, struct fchar_batch __user *ubatch)
+{
+	struct fchar_dev *dev = fchar_dev(filp);
+	struct fchar_op __user *uops;
+	struct fchar_batch batch;
+	struct fchar_op op;
+	bool written = false;
+	long err = 0;
+	ssize_t ret;
+	u32 i;
+
+	if (dev->flags & FCHAR_F_RECORDS)
+		return -EINVAL;
+	if (__copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.nr > ULONG_MAX / sizeof(*uops))
+		return -EINVAL;
+	uops = (struct fchar_op __user *)(unsigned long)batch.ops;
+	if (!access_ok(VERIFY_WRITE, uops, batch.nr * sizeof(*uops)))
+		return -EFAULT;
+
+	for (i = 0; i < batch.nr; i++) {
+		if (__copy_from_user(&op, &uops[i], sizeof(op))) {
+			err = -EFAULT;
+			break;
+		}
+		if (op.opcode == FCHAR_OP_READ)
+			fchar_mark_seen(filp);
+		ret = fchar_exec_op(dev, &op);
+		if (__put_user((__s64)ret, &uops[i].result)) {
+			err = -EFAULT;
+			break;
+		}
+		if (ret > 0 && op.opcode != FCHAR_OP_READ)
+			written = true;
+		if (ret < 0 && (batch.flags & FCHAR_BATCH_STOP_ON_ERROR)) {
+			i++;
+			break;
+		}
+		if (signal_pending(current)) {
+			i++;
+			break;
+		}
+	}
+	if (written)
+		fchar_notify(dev);
+
+	return i ? i : err;
+}
+
 /*
- * FCHAR_VM_FAULT: set this to use the VM fault() method, instead of
- * remap_pfn_range(), to remap on a page-by-page basis (on-demand mapping).
- *
- * NOTE: one of the limitations of fault() is that it can only handle
- * situations where the relevant physical memory has a corresponding struct
- * page. Those structures exist for main memory, but they do not exist when the
- * memory is, for example, on a peripheral device and mapped into a PCI I/O
- * memory region. In such cases, drivers must explicitly map the memory into
- * user space with remap_pfn_range() instead of using the fault() method.
+ * Submission/completion queues (FCHAR_IOCQSETUP): see the protocol
+ * description in fchar.h. Like in ring mode, nothing read from the shared
+ * header can be trusted: the worker keeps its own copy of the positions it
+ * owns and only reads the ones advanced by userspace.
  */
-#undef FCHAR_VM_FAULT
+static ssize_t __fchar_exec_sqe(struct fchar_dev *dev,
+				const struct fchar_sqe *sqe)
+{
+	switch (sqe->opcode) {
+	case FCHAR_OP_FILL:
+		if (!fchar_valid_range(dev, sqe->offset, sqe->len))
+			return -EINVAL;
+		return fchar_fill(dev, sqe->offset, sqe->len,
+				sqe->value & 0xff);
+	case FCHAR_OP_COPY:
+		if (!fchar_valid_range(dev, sqe->offset, sqe->len) ||
+				!fchar_valid_range(dev, sqe->src, sqe->len))
+			return -EINVAL;
+		return fchar_move(dev, sqe->offset, sqe->src, sqe->len);
+	case FCHAR_OP_NOTIFY:
+		fchar_notify(dev);
+		return 0;
+	}
+	return -EINVAL;
+}
 
-#define FCHAR_NR		1
-#define DEFAULT_FCHAR_SIZE	(PAGE_SIZE * 8)
+static ssize_t fchar_exec_sqe(struct fchar_dev *dev,
+			      const struct fchar_sqe *sqe)
+{
+	ssize_t ret;
+	int idx;
 
-static int fchar_size = DEFAULT_FCHAR_SIZE;
-module_param(fchar_size, int, 0);
-MODULE_PARM_DESC(fchar_size, "Size of the device in bytes");
+	idx = srcu_read_lock(&fchar_srcu);
+	ret = __fchar_exec_sqe(dev, sqe);
+	srcu_read_unlock(&fchar_srcu, idx);
 
-static int fchar_debug;
-module_param(fchar_debug, int, 0644);
-MODULE_PARM_DESC(fchar_debug, "Enable module debugging");
+	return ret;
+}
 
-/* Fast-character device structures */
-static int major;
-static struct class *fchar_class;
-static struct cdev fchar_cdev;
-static unsigned char *fchar_data;
+static inline bool fchar_queue_sq_empty(struct fchar_queue_ctx *q)
+{
+	return ACCESS_ONCE(q->hdr->sq_tail) == q->sq_head;
+}
 
-static inline size_t size_inside_page(unsigned long start,
-				      unsigned long size)
+static inline bool fchar_queue_cq_full(struct fchar_queue_ctx *q)
 {
-	unsigned long sz;
+	return q->cq_tail - ACCESS_ONCE(q->hdr->cq_head) > q->cq_mask;
+}
 
-	sz = PAGE_SIZE - (start & (PAGE_SIZE - 1));
+/* Execute the pending entries, as long as there is room for completions */
+static unsigned int fchar_queue_drain(struct fchar_queue_ctx *q)
+{
+	struct fchar_queue *hdr = q->hdr;
+	u32 tail = ACCESS_ONCE(hdr->sq_tail);
+	struct fchar_sqe sqe;
+	struct fchar_cqe *cqe;
+	unsigned int n = 0;
 
-	return min(sz, size);
+	/* Pairs with the release of sq_tail in userspace */
+	smp_rmb();
+	if (tail - q->sq_head > q->sq_mask + 1)
+		tail = q->sq_head + q->sq_mask + 1;
+	while (q->sq_head != tail && !fchar_queue_cq_full(q)) {
+		sqe = q->sqes[q->sq_head & q->sq_mask];
+		/* The entry has been copied, give the slot back */
+		smp_mb();
+		ACCESS_ONCE(hdr->sq_head) = ++q->sq_head;
+
+		cqe = &q->cqes[q->cq_tail & q->cq_mask];
+		cqe->user_data = sqe.user_data;
+		cqe->result = fchar_exec_sqe(q->dev, &sqe);
+		smp_wmb();
+		ACCESS_ONCE(hdr->cq_tail) = ++q->cq_tail;
+		n++;
+	}
+	return n;
 }
 
-static int fchar_open(struct inode *inode, struct file *filp)
+static int fchar_queue_thread(void *data)
 {
-	fchar_trace("%s\n", __func__);
+	struct fchar_queue_ctx *q = data;
+	u64 idle = local_clock();
+	DEFINE_WAIT(wait);
+
+	while (!kthread_should_stop()) {
+		if (fchar_queue_drain(q)) {
+			idle = local_clock();
+			cond_resched();
+			continue;
+		}
+		if (local_clock() - idle < q->spin_ns) {
+			cpu_relax();
+			cond_resched();
+			continue;
+		}
+		prepare_to_wait(&q->wait, &wait, TASK_INTERRUPTIBLE);
+		ACCESS_ONCE(q->hdr->flags) = FCHAR_QUEUE_NEED_WAKEUP;
+		/* Pairs with the barrier between sq_tail and flags in userspace */
+		smp_mb();
+		if (!kthread_should_stop()) {
+			if (fchar_queue_sq_empty(q))
+				schedule();
+			else if (fchar_queue_cq_full(q))
+				/* Nobody tells us when the CQ is drained */
+				schedule_timeout(1);
+		}
+		finish_wait(&q->wait, &wait);
+		ACCESS_ONCE(q->hdr->flags) = 0;
+		idle = local_clock();
+	}
 	return 0;
 }
 
-static int fchar_release(struct inode *inode, struct file *filp)
+static void fchar_queue_destroy(struct fchar_queue_ctx *q)
 {
-	fchar_trace("%s\n", __func__);
-	return 0;
+	kthread_stop(q->task);
+	vfree(q->hdr);
+	kfree(q);
 }
 
-static ssize_t fchar_read(struct file *filp, char __user *buf,
-				size_t count, loff_t *ppos)
+static long fchar_queue_setup(struct file *filp,
+			      struct fchar_queue_params __user *uparams)
 {
-	ssize_t chunk, read;
+	struct fchar_file *ff = filp->private_data;
+	struct fchar_dev *dev = ff->dev;
+	struct fchar_queue_params params;
+	struct fchar_queue_ctx *q;
+	size_t cq_offset;
+	int ret;
 
-	if (!access_ok(VERIFY_WRITE, buf, count))
+	BUILD_BUG_ON(sizeof(struct fchar_queue) > PAGE_SIZE);
+
+	if (dev->flags & FCHAR_F_RECORDS)
+		return -EINVAL;
+	if (copy_from_user(&params, uparams, sizeof(params)))
 		return -EFAULT;
+	if (!is_power_of_2(params.sq_entries) ||
+			params.sq_entries > FCHAR_QUEUE_MAX_ENTRIES ||
+			!is_power_of_2(params.cq_entries) ||
+			params.cq_entries > FCHAR_QUEUE_MAX_ENTRIES ||
+			params.spin_us > FCHAR_QUEUE_MAX_SPIN_US)
+		return -EINVAL;
+	if (params.cpu >= 0 &&
+			(params.cpu >= nr_cpu_ids || !cpu_online(params.cpu)))
+		return -EINVAL;
+	if (ff->queue)
+		return -EBUSY;
 
-	fchar_trace("%s(%zd, %lld)\n", __func__, count, *ppos);
-	read = 0;
-	while (count > 0) {
-		loff_t p = *ppos;
-		ssize_t copied;
+	q = kzalloc(sizeof(*q), GFP_KERNEL);
+	if (unlikely(!q))
+		return -ENOMEM;
+	q->dev = dev;
+	cq_offset = PAGE_SIZE + ALIGN(params.sq_entries *
+			sizeof(struct fchar_sqe), FCHAR_RING_CACHELINE);
+	q->size = PAGE_ALIGN(cq_offset +
+			params.cq_entries * sizeof(struct fchar_cqe));
+	q->hdr = vmalloc_user(q->size);
+	if (unlikely(!q->hdr)) {
+		kfree(q);
+		return -ENOMEM;
+	}
+	q->hdr->sq_entries = params.sq_entries;
+	q->hdr->cq_entries = params.cq_entries;
+	q->hdr->sq_offset = PAGE_SIZE;
+	q->hdr->cq_offset = cq_offset;
+	q->sqes = (void *)q->hdr + PAGE_SIZE;
+	q->cqes = (void *)q->hdr + cq_offset;
+	q->sq_mask = params.sq_entries - 1;
+	q->cq_mask = params.cq_entries - 1;
+	q->spin_ns = (u64)params.spin_us * NSEC_PER_USEC;
+	init_waitqueue_head(&q->wait);
 
-		chunk = size_inside_page(p, count);
-		if (p >= fchar_size)
-			break;
-		if (p + chunk > fchar_size)
-			chunk = fchar_size - p;
+	q->task = kthread_create(fchar_queue_thread, q, "fchar%d-queue",
+				 dev->minor);
+	if (IS_ERR(q->task)) {
+		ret = PTR_ERR(q->task);
+		vfree(q->hdr);
+		kfree(q);
+		return ret;
+	}
+	if (params.cpu >= 0)
+		kthread_bind(q->task, params.cpu);
+	if (cmpxchg(&ff->queue, NULL, q)) {
+		fchar_queue_destroy(q);
+		return -EBUSY;
+	}
+	wake_up_process(q->task);
 
-		copied = copy_to_user(buf, fchar_data + p, chunk);
+	params.size = q->size;
+	params.pid = task_pid_nr(q->task);
+	if (copy_to_user(uparams, &params, sizeof(params)))
+		return -EFAULT;
+	return 0;
+}
 
-		read += chunk - copied;
-		*ppos += chunk - copied;
-		if (copied)
-			break;
-		if (signal_pending(current))
-			return read ? read : -ERESTARTSYS;
-		buf += chunk;
-		count -= chunk;
+static long fchar_queue_wake(struct file *filp)
+{
+	struct fchar_file *ff = filp->private_data;
+
+	if (!ff->queue)
+		return -EINVAL;
+	wake_up(&ff->queue->wait);
+	return 0;
+}
+
+static int fchar_queue_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct fchar_file *ff = filp->private_data;
+	struct fchar_queue_ctx *q = ff->queue;
+
+	if (!q || vma->vm_end - vma->vm_start > q->size)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, q->hdr, 0);
+}
+
+/*
+ * Persistence: a plain device can be backed by a file (fchar_files). Each
+ * page is read from the file the first time it's touched, so a warm restart
+ * only costs the pages that are actually used, and fchar_flush() writes back
+ * the pages dirtied since the last flush: it's called by fsync(),
+ * FCHAR_IOCFLUSH and when the module is unloaded.
+ *
+ * Stores through mmap() can't be tracked: the pages faulted in by a shared
+ * writable mapping are dirty, and stay dirty as long as they are mapped.
+ */
+#define FCHAR_FLUSH_PAGES	16
+
+static ssize_t fchar_store_write(struct fchar_dev *dev, const void *buf,
+				 size_t count, loff_t pos)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t ret;
 
+	set_fs(KERNEL_DS);
+	ret = vfs_write(dev->store, (const char __user *)buf, count, &pos);
+	set_fs(old_fs);
+
+	return ret;
+}
+
+static int fchar_store_truncate(struct fchar_dev *dev, loff_t size)
+{
+	struct dentry *dentry = dev->store->f_path.dentry;
+	struct iattr attr = {
+		.ia_valid = ATTR_SIZE | ATTR_FILE,
+		.ia_size = size,
+		.ia_file = dev->store,
+	};
+	int ret;
+
+	mutex_lock(&dentry->d_inode->i_mutex);
+	ret = notify_change(dentry, &attr);
+	mutex_unlock(&dentry->d_inode->i_mutex);
+
+	return ret;
+}
+
+/* Copy a run of dirty pages to buf and mark them clean */
+static void fchar_flush_copy(struct fchar_dev *dev, void *buf,
+			     unsigned long first, unsigned long end)
+{
+	struct fchar_range range;
+	struct page *page;
+	unsigned long i;
+
+	/* Get a snapshot that no write() was in the middle of */
+	fchar_range_lock(dev, &range, (loff_t)first << PAGE_SHIFT,
+			 (end - first) << PAGE_SHIFT);
+	for (i = first; i < end; i++) {
+		page = fchar_lookup_page(dev, i);
+		clear_bit(i, dev->dirty);
+		memcpy(buf + ((i - first) << PAGE_SHIFT), page_address(page),
+		       PAGE_SIZE);
+		if (page_mapped(page))
+			set_bit(i, dev->dirty);
+	}
+	fchar_range_unlock(dev, &range);
+}
+
+static int fchar_flush(struct fchar_dev *dev)
+{
+	unsigned long first, end, nr;
+	void *buf;
+	ssize_t ret;
+	int err = 0;
+
+	if (!dev->store)
+		return -EINVAL;
+	buf = vmalloc(FCHAR_FLUSH_PAGES << PAGE_SHIFT);
+	if (unlikely(!buf))
+		return -ENOMEM;
+
+	/* Keep the size (and the pages) stable */
+	mutex_lock(&dev->lock);
+	nr = dev->size >> PAGE_SHIFT;
+	for (first = find_first_bit(dev->dirty, nr); first < nr;
+			first = find_next_bit(dev->dirty, nr, end)) {
+		end = first;
+		while (end < nr && end - first < FCHAR_FLUSH_PAGES &&
+				test_bit(end, dev->dirty) &&
+				fchar_lookup_page(dev, end))
+			end++;
+		if (end == first) {
+			/* Never loaded (failed write): the file is up to date */
+			clear_bit(first, dev->dirty);
+			end++;
+			continue;
+		}
+		fchar_flush_copy(dev, buf, first, end);
+		ret = fchar_store_write(dev, buf, (end - first) << PAGE_SHIFT,
+					(loff_t)first << PAGE_SHIFT);
+		if (ret != (end - first) << PAGE_SHIFT) {
+			while (end > first)
+				set_bit(--end, dev->dirty);
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
 		cond_resched();
 	}
-	return read;
+	if (!err)
+		err = vfs_fsync(dev->store, 0);
+	mutex_unlock(&dev->lock);
+	vfree(buf);
+
+	fchar_trace("%s: minor %d flushed (%d)\n", __func__, dev->minor, err);
+	return err;
 }
 
-static ssize_t fchar_write(struct file *filp, const char __user *buf,
-				size_t count, loff_t *ppos)
+/*
+ * Online resize (FCHAR_IOCSSIZE) of plain devices.
+ *
+ * The page table and the sequence counters are allocated for max_size, so
+ * growing only moves the end of the device and shrinking drops the pages
+ * past the new end: the pages below it are never copied nor moved and the
+ * existing mappings stay valid, except that the truncated range now gets
+ * SIGBUS (and the grown range reads as zeroes).
+ *
+ * Every user of the pages samples the size once, within fchar_srcu, so after
+ * a grace period nobody can reach the truncated pages anymore, except the
+ * page tables: the faults in flight are waited for on the page lock, then
+ * the truncated range is unmapped from all the files of the device.
+ */
+static long fchar_resize(struct fchar_dev *dev, int __user *usize)
 {
-	ssize_t chunk, written;
+	unsigned long i, first, last;
+	struct page *page;
+	size_t size, old;
+	int val, ret = 0;
 
-	if (!access_ok(VERIFY_READ, buf, count))
+	if (!fchar_sparse(dev))
+		return -EINVAL;
+	if (__get_user(val, usize))
 		return -EFAULT;
+	if (val <= 0 || PAGE_ALIGN(val) > dev->max_size)
+		return -EINVAL;
+	size = PAGE_ALIGN(val);
 
-	fchar_trace("%s(%zd, %lld)\n", __func__, count, *ppos);
-	written = 0;
-	while (count > 0) {
-		loff_t p = *ppos;
-		ssize_t copied;
+	mutex_lock(&dev->lock);
+	old = dev->size;
+	ACCESS_ONCE(dev->size) = size;
+	if (size < old) {
+		synchronize_srcu(&fchar_srcu);
+		first = size >> PAGE_SHIFT;
+		last = old >> PAGE_SHIFT;
+		for (i = first; i < last; i++) {
+			page = dev->pages[i];
+			if (page) {
+				lock_page(page);
+				unlock_page(page);
+			}
+		}
+		unmap_mapping_range(dev->inode->i_mapping, size, old - size, 1);
+		for (i = first; i < last; i++) {
+			page = dev->pages[i];
+			dev->pages[i] = NULL;
+			if (page)
+				put_page(page);
+		}
+		/* Don't load the old contents if the device grows back */
+		if (dev->store) {
+			for (i = first; i < last; i++)
+				clear_bit(i, dev->dirty);
+			ret = fchar_store_truncate(dev, size);
+		}
+	}
+	mutex_unlock(&dev->lock);
 
-		chunk = size_inside_page(p, count);
-		if (p >= fchar_size)
-			break;
-		if (p + chunk > fchar_size)
-			chunk = fchar_size - p;
+	fchar_trace("%s: minor %d resized from %zu to %zu bytes\n",
+		__func__, dev->minor, old, size);
+	return ret;
+}
 
-		copied = copy_from_user(fchar_data + p, buf, chunk);
-		written += chunk - copied;
-		*ppos += chunk - copied;
-		if (copied)
-			break;
-		if (signal_pending(current))
-			return written ? written : -ERESTARTSYS;
-		buf += chunk;
-		count -= chunk;
+/*
+ * A plain device is readable when it has been written (or committed) since
+ * the last read() through this file, or FCHAR_IOCGGEN for mmap() readers. A
+ * ring device is readable when it holds a message and writable when there
+ * is free space.
+ */
+static unsigned int fchar_poll(struct file *filp, poll_table *wait)
+{
+	struct fchar_file *ff = filp->private_data;
+	struct fchar_dev *dev = ff->dev;
+	unsigned int mask = 0;
 
-		cond_resched();
+	poll_wait(filp, &dev->wait, wait);
+
+	if (dev->flags & FCHAR_F_RING) {
+		if (!fchar_ring_empty(dev))
+			mask |= POLLIN | POLLRDNORM;
+		if (fchar_ring_fits(dev, 0))
+			mask |= POLLOUT | POLLWRNORM;
+	} else {
+		if ((u32)atomic_read(&dev->gen) != ff->seen)
+			mask |= POLLIN | POLLRDNORM;
+		mask |= POLLOUT | POLLWRNORM;
 	}
-	return written;
+	return mask;
 }
 
 static long fchar_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+	struct fchar_file *ff = filp->private_data;
+	struct fchar_dev *dev = ff->dev;
 	void __user *ptr = (void __user *)arg;
 	int ret;
 
@@ -181,8 +2573,31 @@ static long fchar_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	switch (cmd) {
 	case FCHAR_IOCGSIZE:
-		ret = __put_user(fchar_size, (int __user *)ptr);
+		ret = __put_user((int)fchar_dev_size(dev), (int __user *)ptr);
+		break;
+	case FCHAR_IOCSSIZE:
+		return fchar_resize(dev, ptr);
+	case FCHAR_IOCRESET:
+		return fchar_shard_reset(dev);
+	case FCHAR_IOCFLUSH:
+		return fchar_flush(dev);
+	case FCHAR_IOCGFLAGS:
+		ret = __put_user(dev->flags, (int __user *)ptr);
+		break;
+	case FCHAR_IOCCOMMIT:
+		fchar_notify(dev);
+		ret = 0;
 		break;
+	case FCHAR_IOCGGEN:
+		fchar_mark_seen(filp);
+		ret = __put_user(ff->seen, (__u32 __user *)ptr);
+		break;
+	case FCHAR_IOCBATCH:
+		return fchar_batch(filp, ptr);
+	case FCHAR_IOCQSETUP:
+		return fchar_queue_setup(filp, ptr);
+	case FCHAR_IOCQWAKE:
+		return fchar_queue_wake(filp);
 	default:
 		return -EINVAL;
 	}
@@ -192,35 +2607,60 @@ static long fchar_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 void fchar_vma_open(struct vm_area_struct *vma)
 {
-	fchar_trace("%s: virt = %#lx, phys = %#lx\n",
-		__func__, vma->vm_start,
-		vmalloc_to_pfn(fchar_data) << PAGE_SHIFT);
+	struct fchar_dev *dev = vma->vm_private_data;
+
+	fchar_trace("%s: virt = %#lx, minor = %d\n",
+		__func__, vma->vm_start, dev->minor);
 }
 
 void fchar_vma_close(struct vm_area_struct *vma)
 {
-	fchar_trace("%s: virt = %#lx, phys = %#lx\n",
-		__func__, vma->vm_start,
-		vmalloc_to_pfn(fchar_data) << PAGE_SHIFT);
+	struct fchar_dev *dev = vma->vm_private_data;
+
+	fchar_trace("%s: virt = %#lx, minor = %d\n",
+		__func__, vma->vm_start, dev->minor);
 }
 
-#ifdef FCHAR_VM_FAULT
+/*
+ * Sparse devices are mapped on demand, a page at a time: a fault on a hole
+ * fills it, like a write() would do, and a fault past the end of the device
+ * gets SIGBUS. Ring and huge devices are fully mapped by fchar_mmap(), so
+ * they never get here.
+ *
+ * The page is returned locked: fchar_resize() takes the lock of the pages it
+ * drops, so it doesn't miss a mapping that is being set up.
+ */
 static int fchar_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	const void *pos;
+	struct fchar_dev *dev = vma->vm_private_data;
+	struct page *page;
+	int ret = VM_FAULT_SIGBUS;
+	int idx;
 
-	if ((vmf->pgoff << PAGE_SHIFT) >= fchar_size)
+	if (unlikely(!fchar_sparse(dev)))
 		return VM_FAULT_SIGBUS;
-	pos = fchar_data + (vmf->pgoff << PAGE_SHIFT);
-	vmf->page = vmalloc_to_page(pos);
-
-	get_page(vmf->page);
-
-	return 0;
+	idx = srcu_read_lock(&fchar_srcu);
+	if ((vmf->pgoff << PAGE_SHIFT) >= fchar_dev_size(dev))
+		goto out;
+	page = fchar_get_page(dev, vmf->pgoff);
+	if (IS_ERR(page)) {
+		if (PTR_ERR(page) == -ENOMEM)
+			ret = VM_FAULT_OOM;
+		goto out;
+	}
+	/* Stores through the mapping can't be tracked, see fchar_flush() */
+	if (dev->dirty && (vma->vm_flags & VM_SHARED) &&
+			(vma->vm_flags & VM_WRITE))
+		set_bit(vmf->pgoff, dev->dirty);
+	fchar_heat(dev, FCHAR_HEAT_FAULT, vmf->pgoff << PAGE_SHIFT, PAGE_SIZE);
+	get_page(page);
+	lock_page(page);
+	vmf->page = page;
+	ret = VM_FAULT_LOCKED;
+out:
+	srcu_read_unlock(&fchar_srcu, idx);
+	return ret;
 }
-#else /* FCHAR_VM_FAULT */
-#define fchar_vm_fault	NULL
-#endif /* FCHAR_VM_FAULT  */
 
 static struct vm_operations_struct fchar_mem_ops = {
 	.open	= fchar_vma_open,
@@ -228,22 +2668,43 @@ static struct vm_operations_struct fchar_mem_ops = {
 	.fault = fchar_vm_fault,
 };
 
-static int fchar_mmap(struct file *filp, struct vm_area_struct *vma)
+/*
+ * Huge devices are physically contiguous within each chunk, so every chunk
+ * is mapped with a single remap_pfn_range() call.
+ */
+static int fchar_remap_huge(struct fchar_dev *dev, struct vm_area_struct *vma)
 {
-#ifndef FCHAR_VM_FAULT
 	unsigned long start = vma->vm_start;
 	unsigned long size = vma->vm_end - vma->vm_start;
-	unsigned long pfn;
-	const void *pos;
+	unsigned int i;
 
-	if (unlikely(size > fchar_size))
-		return -EFAULT;
+	for (i = 0; size > 0; i++) {
+		unsigned long len = min_t(unsigned long, size, FCHAR_HUGE_SIZE);
+
+		if (remap_pfn_range(vma, start, page_to_pfn(dev->chunks[i]),
+					len, PAGE_SHARED))
+			return -EAGAIN;
+		start += len;
+		size -= len;
+	}
+	return 0;
+}
 
-	fchar_trace("%s: virt = %#lx, phys = %#lx\n",
-		__func__, vma->vm_start,
-		vmalloc_to_pfn(fchar_data) << PAGE_SHIFT);
+/* Ring and huge devices: map the whole buffer upfront */
+static int fchar_remap(struct fchar_dev *dev, struct vm_area_struct *vma)
+{
+	unsigned long start = vma->vm_start;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long pfn;
+	const void *pos;
+	ktime_t begin = ktime_get();
 
-	pos = fchar_data;
+	if (dev->flags & FCHAR_F_HUGE) {
+		if (fchar_remap_huge(dev, vma))
+			return -EAGAIN;
+		size = 0;
+	}
+	pos = dev->data;
 	while (size > 0) {
 		pfn = vmalloc_to_pfn(pos);
 		if (remap_pfn_range(vma, start, pfn, PAGE_SIZE, PAGE_SHARED))
@@ -255,23 +2716,61 @@ static int fchar_mmap(struct file *filp, struct vm_area_struct *vma)
 		else
 			size = 0;
 	}
-#endif /* FCHAR_USE_FAULT */
+	fchar_trace("%s: %lu bytes mapped in %lld ns\n", __func__,
+		vma->vm_end - vma->vm_start,
+		ktime_to_ns(ktime_sub(ktime_get(), begin)));
+	return 0;
+}
+
+static int fchar_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct fchar_dev *dev = fchar_dev(filp);
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff == FCHAR_QUEUE_OFFSET >> PAGE_SHIFT)
+		return fchar_queue_mmap(filp, vma);
+	/* Sparse devices can be mapped up to the size they can grow to */
+	if (unlikely(size > dev->max_size))
+		return -EFAULT;
+
+	fchar_trace("%s: virt = %#lx, minor = %d\n",
+		__func__, vma->vm_start, dev->minor);
 
-	/* remove from LRU scan and core dump */
-	vma->vm_flags |= VM_LOCKED | VM_IO;
+	if (fchar_sparse(dev)) {
+		/* populated by fchar_vm_fault(), skip swap and core dump */
+		vma->vm_flags |= VM_RESERVED | VM_DONTEXPAND;
+	} else {
+		if (fchar_remap(dev, vma))
+			return -EAGAIN;
+		/* remove from LRU scan and core dump */
+		vma->vm_flags |= VM_LOCKED | VM_IO;
+	}
+	vma->vm_private_data = dev;
 	vma->vm_ops = &fchar_mem_ops;
 	fchar_vma_open(vma);
 
 	return 0;
 }
 
+static int fchar_fsync(struct file *filp, loff_t start, loff_t end,
+		       int datasync)
+{
+	return fchar_flush(fchar_dev(filp));
+}
+
 static const struct file_operations fchar_fops = {
 	.open		= fchar_open,
 	.release	= fchar_release,
 	.read		= fchar_read,
 	.write		= fchar_write,
+	.aio_read	= fchar_aio_read,
+	.aio_write	= fchar_aio_write,
+	.poll		= fchar_poll,
+	.fsync		= fchar_fsync,
 	.unlocked_ioctl	= fchar_ioctl, /* don't need BKL */
 	.mmap		= fchar_mmap,
+	.splice_read	= fchar_splice_read,
+	.splice_write	= fchar_splice_write,
 	.owner		= THIS_MODULE,
 };
 
@@ -280,14 +2779,14 @@ static char *fchar_devnode(struct device *dev, umode_t *mode)
 	return kasprintf(GFP_KERNEL, "fchar/%s", dev_name(dev));
 }
 
-static void *alloc_data(ssize_t size)
+static void *alloc_data(ssize_t size, int node)
 {
 	void *mem, *addr;
 
 	WARN_ON(size & (PAGE_SIZE - 1));
 	size = PAGE_ALIGN(size);
 
-	mem = vmalloc(size);
+	mem = vmalloc_node(size, node);
 	if (!mem)
 		return NULL;
 	if (unlikely((size_t)mem & (PAGE_SIZE - 1))) {
@@ -329,24 +2828,215 @@ static void free_data(const void *mem, ssize_t size)
 	vfree(mem);
 }
 
+static struct page **alloc_sparse_data(ssize_t size, int node)
+{
+	WARN_ON(size & (PAGE_SIZE - 1));
+
+	/* Only the page table: the pages come with the first write or fault */
+	return vzalloc_node((PAGE_ALIGN(size) >> PAGE_SHIFT) *
+				sizeof(struct page *), node);
+}
+
+static void free_sparse_data(struct fchar_dev *dev)
+{
+	unsigned long i;
+
+	if (!dev->pages)
+		return;
+	for (i = 0; i < dev->max_size >> PAGE_SHIFT; i++)
+		if (dev->pages[i])
+			put_page(dev->pages[i]);
+	vfree(dev->pages);
+	dev->pages = NULL;
+}
+
+static void free_huge_data(struct fchar_dev *dev)
+{
+	unsigned int i, j;
+
+	if (dev->data)
+		vunmap(dev->data);
+	if (!dev->chunks)
+		return;
+	for (i = 0; i < dev->nr_chunks; i++) {
+		struct page *page = dev->chunks[i];
+
+		if (!page)
+			break;
+		for (j = 0; j < (1 << FCHAR_HUGE_ORDER); j++) {
+			ClearPageReserved(page + j);
+			__free_page(page + j);
+		}
+	}
+	kfree(dev->chunks);
+	dev->chunks = NULL;
+}
+
+static void *alloc_huge_data(struct fchar_dev *dev, int node)
+{
+	unsigned int nr_pages = dev->size >> PAGE_SHIFT;
+	unsigned int i, j, n = 0;
+	struct page **pages;
+	void *mem = NULL;
+
+	dev->nr_chunks = dev->size / FCHAR_HUGE_SIZE;
+	dev->chunks = kcalloc(dev->nr_chunks, sizeof(*dev->chunks), GFP_KERNEL);
+	pages = vmalloc(nr_pages * sizeof(*pages));
+	if (!dev->chunks || !pages)
+		goto out;
+
+	for (i = 0; i < dev->nr_chunks; i++) {
+		struct page *page;
+
+		page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO |
+					__GFP_NOWARN, FCHAR_HUGE_ORDER);
+		if (!page) {
+			printk(KERN_WARNING "fchar: can't allocate %lu "
+					"contiguous bytes\n", FCHAR_HUGE_SIZE);
+			goto out;
+		}
+		/*
+		 * Keep the chunk physically contiguous, but let each page be
+		 * referenced on its own (splice, faults).
+		 */
+		split_page(page, FCHAR_HUGE_ORDER);
+		dev->chunks[i] = page;
+		for (j = 0; j < (1 << FCHAR_HUGE_ORDER); j++) {
+			SetPageReserved(page + j);
+			pages[n++] = page + j;
+		}
+	}
+	/* Give the kernel a linear view, like vmalloc() */
+	mem = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+out:
+	vfree(pages);
+	if (!mem)
+		free_huge_data(dev);
+	return mem;
+}
+
+static int fchar_setup_devs(void)
+{
+	int i;
+
+	fchar_devs = kcalloc(fchar_nr, sizeof(*fchar_devs), GFP_KERNEL);
+	if (!fchar_devs)
+		return -ENOMEM;
+	for (i = 0; i < fchar_nr; i++) {
+		struct fchar_dev *dev = &fchar_devs[i];
+		int size = fchar_size;
+
+		fchar_init_dev(dev, i);
+		if (i < fchar_sizes_nr && fchar_sizes[i])
+			size = fchar_sizes[i];
+		if (size <= 0) {
+			printk(KERN_ERR "fchar: invalid size %d for minor %d\n",
+					size, i);
+			kfree(fchar_devs);
+			return -EINVAL;
+		}
+		if (i < fchar_flags_nr)
+			dev->flags = fchar_flags[i];
+		if (i < fchar_files_nr && fchar_files[i] && *fchar_files[i]) {
+			if (!fchar_sparse(dev)) {
+				printk(KERN_ERR "fchar: minor %d: backing files "
+						"need a plain device\n", i);
+				kfree(fchar_devs);
+				return -EINVAL;
+			}
+			dev->store_path = fchar_files[i];
+		}
+		if (hweight32(dev->flags & (FCHAR_F_RING | FCHAR_F_HUGE |
+					FCHAR_F_SHARDED)) > 1) {
+			printk(KERN_ERR "fchar: minor %d: ring, huge and "
+					"sharded modes are mutually exclusive\n",
+					i);
+			kfree(fchar_devs);
+			return -EINVAL;
+		}
+		/*
+		 * Ring devices need a header page in front of a power-of-two
+		 * data area, sharded devices are split in page-aligned shards.
+		 */
+		if (dev->flags & FCHAR_F_RING) {
+			dev->size = PAGE_SIZE +
+				roundup_pow_of_two(PAGE_ALIGN(size));
+		} else if (dev->flags & FCHAR_F_HUGE) {
+			dev->size = ALIGN(size, FCHAR_HUGE_SIZE);
+		} else if (dev->flags & FCHAR_F_SHARDED) {
+			dev->nr_shards = nr_cpu_ids;
+			dev->shard_size = PAGE_ALIGN(DIV_ROUND_UP(size,
+						dev->nr_shards));
+			dev->size = dev->shard_size * dev->nr_shards;
+		} else {
+			dev->size = PAGE_ALIGN(size);
+		}
+		dev->max_size = dev->size;
+		if (fchar_sparse(dev))
+			dev->max_size = max_t(size_t, dev->size,
+					PAGE_ALIGN(fchar_max_size));
+		/* The queues are mapped past the end of the largest device */
+		if (dev->max_size > FCHAR_QUEUE_OFFSET) {
+			printk(KERN_ERR "fchar: minor %d: devices are limited "
+					"to %llu bytes\n", i, FCHAR_QUEUE_OFFSET);
+			kfree(fchar_devs);
+			return -EINVAL;
+		}
+		mutex_init(&dev->lock);
+	}
+	return 0;
+}
+
+static void fchar_free_devs(void)
+{
+	int i;
+
+	for (i = 0; i < fchar_nr; i++)
+		fchar_free_dev_data(&fchar_devs[i]);
+	kfree(fchar_devs);
+}
+
+static void fchar_destroy_nodes(int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		device_destroy(fchar_class, MKDEV(major, i));
+}
+
 static int __init fchar_init(void)
 {
 	dev_t dev_id;
-	int ret;
+	struct device *device;
+	int i, ret;
 
-	fchar_data = alloc_data(fchar_size);
-	if (!fchar_data)
-		return -ENOMEM;
+	if (fchar_nr <= 0 || fchar_nr > FCHAR_MAX_NR) {
+		printk(KERN_ERR "fchar: fchar_nr must be in [1, %d]\n",
+				FCHAR_MAX_NR);
+		return -EINVAL;
+	}
+	if (fchar_size <= 0 || fchar_max_size < 0 ||
+			fchar_size > FCHAR_QUEUE_OFFSET ||
+			fchar_max_size > FCHAR_QUEUE_OFFSET)
+		return -EINVAL;
+	ret = init_srcu_struct(&fchar_srcu);
+	if (ret)
+		return ret;
+	ret = fchar_setup_devs();
+	if (ret) {
+		cleanup_srcu_struct(&fchar_srcu);
+		return ret;
+	}
 
 	/* Register major/minor numbers */
-	ret = alloc_chrdev_region(&dev_id, 0, FCHAR_NR, "fchar");
+	ret = alloc_chrdev_region(&dev_id, 0, fchar_nr_minors(), "fchar");
 	if (ret)
 		goto error_alloc;
 	major = MAJOR(dev_id);
 
 	/* Add the character device to the system */
 	cdev_init(&fchar_cdev, &fchar_fops);
-	ret = cdev_add(&fchar_cdev, dev_id, FCHAR_NR);
+	ret = cdev_add(&fchar_cdev, dev_id, fchar_nr_minors());
 	if (ret) {
 		kobject_put(&fchar_cdev.kobj);
 		goto error_region;
@@ -361,18 +3051,41 @@ static int __init fchar_init(void)
 	}
 	fchar_class->devnode = fchar_devnode;
 
-	/* Register the device with sysfs */
-	device_create(fchar_class, NULL, MKDEV(major, 0), NULL, "fcharctl");
-	printk(KERN_INFO "register new fchar device: %d,%d\n", major, 0);
+	/*
+	 * Register the devices with sysfs: minor 0 keeps the historical
+	 * "fcharctl" name, the private device comes after the shared ones.
+	 */
+	for (i = 0; i < fchar_nr_minors(); i++) {
+		if (i == fchar_nr)
+			device = device_create(fchar_class, NULL,
+					MKDEV(major, i), NULL, "fcharpriv");
+		else if (i)
+			device = device_create(fchar_class, NULL,
+					MKDEV(major, i), NULL, "fchar%d", i);
+		else
+			device = device_create(fchar_class, NULL,
+					MKDEV(major, i), NULL, "fcharctl");
+		if (IS_ERR(device)) {
+			ret = PTR_ERR(device);
+			fchar_destroy_nodes(i);
+			goto error_class;
+		}
+		printk(KERN_INFO "register new fchar device: %d,%d\n",
+				major, i);
+	}
+	fchar_heat_init();
 
 out:
 	return ret;
+error_class:
+	class_destroy(fchar_class);
 error_cdev:
 	cdev_del(&fchar_cdev);
 error_region:
-	unregister_chrdev_region(dev_id, FCHAR_NR);
+	unregister_chrdev_region(dev_id, fchar_nr_minors());
 error_alloc:
-	free_data(fchar_data, fchar_size);
+	fchar_free_devs();
+	cleanup_srcu_struct(&fchar_srcu);
 	goto out;
 }
 
@@ -380,11 +3093,13 @@ static void __exit fchar_exit(void)
 {
 	dev_t dev_id = MKDEV(major, 0);
 
-        device_destroy(fchar_class, dev_id);
+	fchar_heat_exit();
+	fchar_destroy_nodes(fchar_nr_minors());
 	class_destroy(fchar_class);
 	cdev_del(&fchar_cdev);
-	unregister_chrdev_region(dev_id, FCHAR_NR);
-	free_data(fchar_data, fchar_size);
+	unregister_chrdev_region(dev_id, fchar_nr_minors());
+	fchar_free_devs();
+	cleanup_srcu_struct(&fchar_srcu);
 }
 
 module_init(fchar_init);
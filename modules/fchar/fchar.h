@@ -20,6 +20,7 @@
  */
 
 #ifndef FCHAR_H
+#define FCHAR_H
 
 #ifndef __KERNEL__
 #include <features.h>
@@ -27,10 +28,278 @@
 #include <linux/types.h>
 #include <linux/ioctl.h>
 
+/* Device flags (fchar_flags module parameter, one value per minor) */
+#define FCHAR_F_RING		(1 << 0)	/* message ring, see below */
+#define FCHAR_F_HUGE		(1 << 1)	/* physically contiguous chunks */
+#define FCHAR_F_SHARDED		(1 << 2)	/* per-CPU append logs, see below */
+
 /* See Documentation/ioctl/ioctl-number.txt */
 #define FCHAR_IOC_MAGIC		0xe0
 #define FCHAR_IOCGSIZE		_IOR(FCHAR_IOC_MAGIC, 1, int)
+#define FCHAR_IOCGFLAGS		_IOR(FCHAR_IOC_MAGIC, 2, int)
+/* Wake up pollers after updating the device through mmap() */
+#define FCHAR_IOCCOMMIT		_IO(FCHAR_IOC_MAGIC, 3)
+/* Get the device generation and mark it as seen (clears POLLIN) */
+#define FCHAR_IOCGGEN		_IOR(FCHAR_IOC_MAGIC, 4, __u32)
+/* Execute an array of operations, see below */
+#define FCHAR_IOCBATCH		_IOW(FCHAR_IOC_MAGIC, 5, struct fchar_batch)
+/* Create the submission/completion queues of this file, see below */
+#define FCHAR_IOCQSETUP		_IOWR(FCHAR_IOC_MAGIC, 6, \
+					struct fchar_queue_params)
+/* Wake up the queue worker (when FCHAR_QUEUE_NEED_WAKEUP is set) */
+#define FCHAR_IOCQWAKE		_IO(FCHAR_IOC_MAGIC, 7)
+/*
+ * Resize a plain device, up to the fchar_max_size module parameter. Existing
+ * mappings stay valid: pages past the new end get SIGBUS, pages added by
+ * growing the device read as zeroes.
+ */
+#define FCHAR_IOCSSIZE		_IOW(FCHAR_IOC_MAGIC, 8, int)
+/* Empty all the shards of a FCHAR_F_SHARDED device */
+#define FCHAR_IOCRESET		_IO(FCHAR_IOC_MAGIC, 9)
+/*
+ * Write back the dirty pages of a device backed by a file (fchar_files
+ * module parameter) and sync the file, like fsync() does: a durability
+ * point. Pages stored through a shared mapping are always written back.
+ */
+#define FCHAR_IOCFLUSH		_IO(FCHAR_IOC_MAGIC, 10)
+
+#define FCHAR_IOC_MAX_NR	10
+
+/*
+ * Batched operations
+ *
+ * FCHAR_IOCBATCH executes nr struct fchar_op in order, in a single system
+ * call, and stores the outcome of each one in its result field: the number
+ * of bytes processed or a negative errno. All the offsets are relative to
+ * the start of the device and [offset, offset + len) must be inside it.
+ *
+ * The ioctl returns the number of executed operations: with
+ * FCHAR_BATCH_STOP_ON_ERROR the batch stops after the first failed one,
+ * otherwise all of them are executed. Not supported in ring mode.
+ */
+#define FCHAR_OP_FILL		1	/* memset() len bytes at offset to value */
+#define FCHAR_OP_COPY		2	/* memmove() len bytes from src to offset */
+#define FCHAR_OP_WRITE		3	/* write len bytes of addr at offset */
+#define FCHAR_OP_READ		4	/* read len bytes at offset into addr */
+#define FCHAR_OP_NOTIFY		5	/* wake up the pollers (queues only) */
+
+struct fchar_op {
+	__u32 opcode;
+	__u32 value;		/* FCHAR_OP_FILL: fill byte */
+	__u64 offset;
+	__u64 src;		/* FCHAR_OP_COPY: source offset */
+	__u64 addr;		/* FCHAR_OP_WRITE/READ: user buffer */
+	__u64 len;
+	__s64 result;		/* out */
+};
+
+#define FCHAR_BATCH_STOP_ON_ERROR	(1 << 0)
+
+struct fchar_batch {
+	__u64 ops;		/* array of struct fchar_op */
+	__u32 nr;
+	__u32 flags;
+};
+
+/*
+ * Ring mode
+ *
+ * A device created with FCHAR_F_RING starts with a header page (struct
+ * fchar_ring), followed by a power-of-two sized data area, starting at
+ * data_offset. Mapping the whole device gives access to both.
+ *
+ * The data area contains variable-sized records: a struct fchar_ring_rec
+ * followed by the payload, padded to FCHAR_RING_ALIGN bytes. A record never
+ * wraps around the end of the data area: when it doesn't fit the producer
+ * fills the tail with a FCHAR_RING_REC_PAD record and starts again from
+ * offset 0. Consumers must skip (consume) padding records.
+ *
+ * Positions are free-running 32-bit counters, the offset of a position in
+ * the data area is (pos & (size - 1)). Each side uses a head/tail pair, each
+ * counter on its own cache line:
+ *
+ *  - a producer reserves space moving prod_head forward with a
+ *    compare-and-swap, writes the record, then waits for prod_tail to reach
+ *    its old head and stores its new head into prod_tail (release);
+ *
+ *  - a consumer reads prod_tail (acquire), reserves the record at cons_head
+ *    with a compare-and-swap, copies the payload out, then waits for
+ *    cons_tail to reach its old head and stores its new head into cons_tail.
+ *
+ * Free space is size - (prod_head - cons_tail). This is safe with any number
+ * of producers and consumers; read() and write() on the device act as one
+ * consumer and one producer respectively, one message per call, and block
+ * unless O_NONBLOCK is set. Processes using the mapping directly must issue
+ * FCHAR_IOCCOMMIT to wake up the pollers and the blocked readers/writers.
+ * See fchar-ring.h for the userspace implementation.
+ *
+ * A producer (consumer) that dies between its compare-and-swap and the store
+ * into prod_tail (cons_tail) stalls that side of the ring for good: the ones
+ * that reserved after it can never publish. read() and write() don't hang
+ * on it: they give up after about one second with -EIO (-EINTR on a fatal
+ * signal) without publishing, and their message is lost. The ring stays
+ * stalled until the header is repaired through the mapping or the device is
+ * created again.
+ */
+#define FCHAR_RING_MAGIC	0x676e7266	/* "frng" */
+#define FCHAR_RING_VERSION	1
+#define FCHAR_RING_CACHELINE	128
+#define FCHAR_RING_ALIGN	8
+
+#define FCHAR_RING_REC_PAD	(1 << 0)
+
+struct fchar_ring_rec {
+	__u32 len;		/* payload length */
+	__u32 flags;
+};
+
+#define FCHAR_RING_REC_SIZE(len)				\
+	(((len) + sizeof(struct fchar_ring_rec) + FCHAR_RING_ALIGN - 1) & \
+	 ~(FCHAR_RING_ALIGN - 1))
+
+struct fchar_ring {
+	__u32 magic;
+	__u32 version;
+	__u32 data_offset;	/* offset of the data area from the header */
+	__u32 size;		/* size of the data area (power of two) */
+	__u32 flags;
+
+	__u32 prod_head __attribute__((aligned(FCHAR_RING_CACHELINE)));
+	__u32 prod_tail __attribute__((aligned(FCHAR_RING_CACHELINE)));
+	__u32 cons_head __attribute__((aligned(FCHAR_RING_CACHELINE)));
+	__u32 cons_tail __attribute__((aligned(FCHAR_RING_CACHELINE)));
+} __attribute__((aligned(FCHAR_RING_CACHELINE)));
+
+/*
+ * Sharded mode
+ *
+ * A device created with FCHAR_F_SHARDED is split in nr_shards shards of
+ * shard_size bytes, one per possible CPU, and each write() appends a record
+ * to the shard of the CPU it runs on: writers on different CPUs never share
+ * a cache line. write() fails with -ENOSPC when the shard is full, until
+ * FCHAR_IOCRESET empties the device.
+ *
+ * Each shard starts with a struct fchar_shard header, followed by the data
+ * area at data_offset. head is the number of bytes of the data area reserved
+ * so far; the records are a struct fchar_shard_rec, stamped with the
+ * local_clock() of the writer, followed by the payload, padded to
+ * FCHAR_RING_ALIGN bytes. A record is complete when FCHAR_SHARD_REC_COMMIT
+ * is set in its flags (acquire): readers of the mapping must stop at the
+ * first record that isn't and skip the FCHAR_SHARD_REC_PAD ones (failed
+ * writes).
+ *
+ * read() returns the records of all the shards in the same format, merged
+ * by timestamp (ties broken by CPU), without the padding ones, and 0 when
+ * there is nothing left: poll() for more. The merge only considers the
+ * complete records, so a record can follow a newer one of another CPU
+ * that has been read first. See fchar-shard.h to merge the shards of the
+ * mapping in userspace.
+ */
+#define FCHAR_SHARD_MAGIC	0x64687366	/* "fshd" */
+#define FCHAR_SHARD_VERSION	1
+
+#define FCHAR_SHARD_REC_COMMIT	(1 << 0)
+#define FCHAR_SHARD_REC_PAD	(1 << 1)
+
+struct fchar_shard_rec {
+	__u64 ts;		/* ns, local_clock() of the writer */
+	__u32 len;		/* payload length */
+	__u16 cpu;
+	__u16 flags;
+};
+
+#define FCHAR_SHARD_REC_SIZE(len)				\
+	(((len) + sizeof(struct fchar_shard_rec) + FCHAR_RING_ALIGN - 1) & \
+	 ~(FCHAR_RING_ALIGN - 1))
+
+struct fchar_shard {
+	__u32 magic;
+	__u32 version;
+	__u32 nr_shards;
+	__u32 shard_size;	/* distance between two shard headers */
+	__u32 data_offset;	/* offset of the data area from the header */
+	__u32 size;		/* size of the data area */
+	__u32 cpu;
+
+	__u32 head __attribute__((aligned(FCHAR_RING_CACHELINE)));
+} __attribute__((aligned(FCHAR_RING_CACHELINE)));
+
+/*
+ * Submission/completion queues
+ *
+ * FCHAR_IOCQSETUP creates a pair of queues for the file it's issued on and
+ * a kernel worker that executes the submitted operations, so a producer can
+ * drive the device without any system call in steady state.
+ *
+ * The queues are mapped with mmap() at offset FCHAR_QUEUE_OFFSET (params.size
+ * bytes): a struct fchar_queue header, the array of sq_entries struct
+ * fchar_sqe at sq_offset and the array of cq_entries struct fchar_cqe at
+ * cq_offset. The offset fits in a 32-bit off_t, so plain mmap() works on
+ * 32-bit userspace too; it must stay past the end of the devices, and the
+ * module refuses to load with a device that could be larger than
+ * FCHAR_QUEUE_OFFSET (after rounding for its mode, fchar_max_size included).
+ *
+ * The two queues are single-producer single-consumer rings of free-running
+ * 32-bit positions, the index of a position is (pos & (entries - 1)):
+ *
+ *  - userspace fills the entry at sq_tail, then advances sq_tail (release);
+ *    the worker advances sq_head after reading an entry;
+ *
+ *  - the worker stores a completion at cq_tail for each executed entry and
+ *    advances cq_tail (release); userspace advances cq_head after reading
+ *    it. The worker doesn't consume more entries while the CQ is full.
+ *
+ * Supported operations are FCHAR_OP_FILL, FCHAR_OP_COPY (within the device,
+ * data is usually stored through the device mapping first) and
+ * FCHAR_OP_NOTIFY; the result is the same as in FCHAR_IOCBATCH.
+ *
+ * The worker busy-polls the SQ for spin_us after the last entry, then goes
+ * to sleep setting FCHAR_QUEUE_NEED_WAKEUP in flags. A producer must check
+ * the flag after advancing sq_tail (with a full barrier in between) and
+ * issue FCHAR_IOCQWAKE when it's set. See fchar-queue.h. spin_us is capped
+ * at FCHAR_QUEUE_MAX_SPIN_US (10 ms), FCHAR_IOCQSETUP fails with -EINVAL
+ * above it: the worker is a kernel thread any user of the device can start.
+ */
+#define FCHAR_QUEUE_OFFSET	0x40000000ULL
+#define FCHAR_QUEUE_MAX_ENTRIES	32768
+#define FCHAR_QUEUE_MAX_SPIN_US	10000
+
+#define FCHAR_QUEUE_NEED_WAKEUP	(1 << 0)
+
+struct fchar_sqe {
+	__u32 opcode;		/* FCHAR_OP_FILL, FCHAR_OP_COPY, FCHAR_OP_NOTIFY */
+	__u32 value;		/* FCHAR_OP_FILL: fill byte */
+	__u64 offset;
+	__u64 src;		/* FCHAR_OP_COPY: source offset */
+	__u64 len;
+	__u64 user_data;	/* returned in the completion */
+};
+
+struct fchar_cqe {
+	__u64 user_data;
+	__s64 result;
+};
+
+struct fchar_queue {
+	__u32 sq_entries;
+	__u32 cq_entries;
+	__u32 sq_offset;	/* offset of the SQ array from the header */
+	__u32 cq_offset;	/* offset of the CQ array from the header */
+	__u32 flags;		/* set by the worker */
+
+	__u32 sq_head __attribute__((aligned(FCHAR_RING_CACHELINE)));
+	__u32 sq_tail __attribute__((aligned(FCHAR_RING_CACHELINE)));
+	__u32 cq_head __attribute__((aligned(FCHAR_RING_CACHELINE)));
+	__u32 cq_tail __attribute__((aligned(FCHAR_RING_CACHELINE)));
+} __attribute__((aligned(FCHAR_RING_CACHELINE)));
 
-#define FCHAR_IOC_MAX_NR	1
+struct fchar_queue_params {
+	__u32 sq_entries;	/* in: power of two */
+	__u32 cq_entries;	/* in: power of two */
+	__u32 spin_us;		/* in: busy-poll time, FCHAR_QUEUE_MAX_SPIN_US max */
+	__s32 cpu;		/* in: CPU of the worker, -1 = any */
+	__u32 size;		/* out: size of the mapping */
+	__u32 pid;		/* out: pid of the worker */
+};
 
 #endif /* FCHAR_H */
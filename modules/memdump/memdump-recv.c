@@ -0,0 +1,1236 @@
+/*
+ * memdump-recv: receiver of the memdump stream
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Copyright (C) 2015 Andrea Righi <righi.andrea@gmail.com>
+ */
+
+/*
+ * Receive a dump from the memdump module, over one connection per stream or
+ * from a file written with path=, and store it as an ELF core file with a
+ * PT_LOAD segment for each RAM range, that crash and gdb can open.
+ *
+ * The core file is sparse: the pages that a sparse dump doesn't send are
+ * holes. With -u the dump goes into an existing core file instead: a delta
+ * dump into the core file of its baseline, or the ranges requested with -R
+ * into the core file of an interrupted dump. When a dump is incomplete (a
+ * stream is truncated, a chunk is corrupted) the missing ranges are printed
+ * in the form of -R, to be requested again with -u.
+ *
+ * A raw stream (the module without options) has no header: the RAM ranges
+ * are taken from a copy of /proc/iomem of the device (-i).
+ *
+ * The uncompressed chunks without checksum are moved from the socket to the
+ * core file with splice(), the others are checked and decompressed in
+ * memory. The throughput is printed on stderr every second.
+ *
+ * The dump must come from a little-endian machine, like the ones of -m.
+ *
+ * Build: make memdump-recv
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <netdb.h>
+#include <elf.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/falloc.h>
+
+#include "memdump.h"
+
+#define MAX_STREAMS		64
+#define MAX_REQUEST_RANGES	4096
+#define MAX_BITMAP_PAGES	(1U << 20)
+#define BUF_SIZE		(1 << 20)
+
+/* Note with the id of the dump in the core file */
+#define NOTE_NAME		"MEMDUMP"
+#define NOTE_TYPE		1
+
+struct note {
+	Elf32_Nhdr nhdr;
+	char name[8];
+	__u32 id;		/* of the dump, 0 if it is incomplete */
+	__u32 flags;		/* MEMDUMP_F_* */
+};
+
+/* A PT_LOAD segment of the core file */
+struct segment {
+	unsigned long long paddr;
+	unsigned long long size;
+	off_t offset;
+	unsigned long long first;	/* index of its first page in done */
+};
+
+struct stream {
+	pthread_t thread;
+	int fd;
+	int index;
+	unsigned char peek[4];	/* read to tell a raw stream, not consumed */
+	unsigned int nr_peek;
+	struct memdump_header hdr;
+	struct memdump_range *ranges;
+	char *buf;		/* pages of a chunk */
+	char *zbuf;		/* compressed chunk */
+	unsigned char *map;	/* bitmap chunk */
+	int pipe[2];
+	bool splice;
+	bool end;		/* end chunk received */
+};
+
+struct machine {
+	const char *name;
+	int machine;
+	int class;
+};
+
+static const struct machine machines[] = {
+	{ "arm",	EM_ARM,		ELFCLASS32 },
+	{ "arm64",	EM_AARCH64,	ELFCLASS64 },
+	{ "x86",	EM_386,		ELFCLASS32 },
+	{ "x86_64",	EM_X86_64,	ELFCLASS64 },
+};
+
+#define NR_MACHINES	(sizeof(machines) / sizeof(machines[0]))
+
+static int port = 4444;
+static int nr_streams = 1;
+static const char *input;
+static const char *iomem;
+static bool request;
+static struct memdump_range req_ranges[MAX_REQUEST_RANGES];
+static unsigned int nr_req;
+static unsigned int baseline;
+static bool update;
+static const struct machine *mach = &machines[0];
+static unsigned long long voffset;
+static int rcvbuf = 4 << 20;
+
+static struct stream streams[MAX_STREAMS];
+static bool raw;
+static unsigned int page_size = 4096;
+
+/* The core file */
+static int core_fd;
+static struct segment *segs;
+static unsigned int nr_segs;
+static off_t note_offset;
+static struct note core_note;
+static unsigned long *done;	/* pages of the dump received */
+
+/* Statistics, updated by all the streams */
+static unsigned long long rx_bytes;
+static unsigned long long ram_bytes;
+static unsigned int bad_chunks;
+
+static __u32 crc_table[256];
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fail(const char *msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+static void *xzalloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (!p)
+		fail("calloc");
+	return p;
+}
+
+/* CRC-32 of zlib, the one of MEMDUMP_F_CRC */
+static void crc_init(void)
+{
+	__u32 c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static __u32 crc32(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__u32 c = ~0U;
+
+	while (len--)
+		c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+	return ~c;
+}
+
+/*
+ * LZO1X decompression, as lzo1x_decompress_safe() of the kernel: 0 on
+ * success, with the length of the output in *out_len, -1 on bad input.
+ */
+static int lzo1x_decompress(const unsigned char *in, size_t in_len,
+			    unsigned char *out, size_t *out_len)
+{
+	const unsigned char *ip = in, *const ip_end = in + in_len;
+	unsigned char *op = out, *const op_end = out + *out_len;
+	const unsigned char *m_pos;
+	size_t t, next, state = 0;
+
+#define NEED_IP(x)	if ((size_t)(ip_end - ip) < (size_t)(x)) return -1
+#define NEED_OP(x)	if ((size_t)(op_end - op) < (size_t)(x)) return -1
+#define TEST_LB(m)	if ((m) < out) return -1
+
+	NEED_IP(3);
+	if (*ip > 17) {
+		t = *ip++ - 17;
+		if (t < 4) {
+			next = t;
+			goto match_next;
+		}
+		goto copy_literal_run;
+	}
+	for (;;) {
+		NEED_IP(1);
+		t = *ip++;
+		if (t < 16) {
+			if (state == 0) {
+				if (t == 0) {
+					NEED_IP(1);
+					while (*ip == 0) {
+						t += 255;
+						ip++;
+						NEED_IP(1);
+					}
+					t += 15 + *ip++;
+				}
+				t += 3;
+copy_literal_run:
+				NEED_OP(t);
+				NEED_IP(t + 3);
+				memcpy(op, ip, t);
+				op += t;
+				ip += t;
+				state = 4;
+				continue;
+			} else if (state != 4) {
+				next = t & 3;
+				NEED_IP(1);
+				m_pos = op - 1 - (t >> 2) - (*ip++ << 2);
+				TEST_LB(m_pos);
+				NEED_OP(2);
+				op[0] = m_pos[0];
+				op[1] = m_pos[1];
+				op += 2;
+				goto match_next;
+			} else {
+				next = t & 3;
+				NEED_IP(1);
+				m_pos = op - (1 + 0x0800) - (t >> 2) -
+					(*ip++ << 2);
+				t = 3;
+			}
+		} else if (t >= 64) {
+			next = t & 3;
+			NEED_IP(1);
+			m_pos = op - 1 - ((t >> 2) & 7) - (*ip++ << 3);
+			t = (t >> 5) - 1 + (3 - 1);
+		} else if (t >= 32) {
+			t = (t & 31) + (3 - 1);
+			if (t == 2) {
+				NEED_IP(1);
+				while (*ip == 0) {
+					t += 255;
+					ip++;
+					NEED_IP(1);
+				}
+				t += 31 + *ip++;
+			}
+			NEED_IP(2);
+			next = ip[0] | ip[1] << 8;
+			ip += 2;
+			m_pos = op - 1 - (next >> 2);
+			next &= 3;
+		} else {
+			m_pos = op - ((t & 8) << 11);
+			t = (t & 7) + (3 - 1);
+			if (t == 2) {
+				NEED_IP(1);
+				while (*ip == 0) {
+					t += 255;
+					ip++;
+					NEED_IP(1);
+				}
+				t += 7 + *ip++;
+			}
+			NEED_IP(2);
+			next = ip[0] | ip[1] << 8;
+			ip += 2;
+			m_pos -= next >> 2;
+			next &= 3;
+			if (m_pos == op) {
+				/* End of stream marker */
+				*out_len = op - out;
+				return t == 3 && ip == ip_end ? 0 : -1;
+			}
+			m_pos -= 0x4000;
+		}
+		TEST_LB(m_pos);
+		NEED_OP(t);
+		/* The match may overlap its own output */
+		while (t--)
+			*op++ = *m_pos++;
+match_next:
+		state = next;
+		t = next;
+		NEED_IP(t + 3);
+		NEED_OP(t);
+		while (t--)
+			*op++ = *ip++;
+	}
+#undef NEED_IP
+#undef NEED_OP
+#undef TEST_LB
+}
+
+static void pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("pwrite");
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+		off += n;
+	}
+}
+
+static void write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("write");
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+}
+
+/* 0 if all the @len bytes have been read, -1 at the end of the stream */
+static int read_full(struct stream *st, void *buf, size_t len)
+{
+	size_t n;
+	ssize_t ret;
+
+	n = st->nr_peek < len ? st->nr_peek : len;
+	memcpy(buf, st->peek, n);
+	memmove(st->peek, st->peek + n, st->nr_peek - n);
+	st->nr_peek -= n;
+	for (; n < len; n += ret) {
+		ret = read(st->fd, (char *)buf + n, len - n);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret <= 0) {
+			if (ret < 0)
+				fprintf(stderr, "stream %d: %s\n", st->index,
+					strerror(errno));
+			return -1;
+		}
+		__sync_fetch_and_add(&rx_bytes, ret);
+	}
+	return 0;
+}
+
+/* Move @len bytes of the stream to the core file, at @off */
+static int copy_to_core(struct stream *st, size_t len, off_t off)
+{
+	ssize_t n, m;
+	size_t chunk;
+
+	if (st->nr_peek) {
+		chunk = st->nr_peek < len ? st->nr_peek : len;
+		pwrite_full(core_fd, st->peek, chunk, off);
+		if (read_full(st, st->buf, chunk))
+			return -1;
+		len -= chunk;
+		off += chunk;
+	}
+	while (len && st->splice) {
+		chunk = len < BUF_SIZE ? len : BUF_SIZE;
+		n = splice(st->fd, NULL, st->pipe[1], NULL, chunk,
+			   SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0 && errno == EINVAL) {
+			/* Not supported by this input: copy */
+			st->splice = false;
+			break;
+		}
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				fprintf(stderr, "stream %d: %s\n", st->index,
+					strerror(errno));
+			return -1;
+		}
+		__sync_fetch_and_add(&rx_bytes, n);
+		len -= n;
+		while (n) {
+			m = splice(st->pipe[0], NULL, core_fd, &off, n,
+				   SPLICE_F_MOVE);
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0)
+				fail("splice");
+			n -= m;
+		}
+	}
+	while (len) {
+		chunk = len < BUF_SIZE ? len : BUF_SIZE;
+		if (read_full(st, st->buf, chunk))
+			return -1;
+		pwrite_full(core_fd, st->buf, chunk, off);
+		len -= chunk;
+		off += chunk;
+	}
+	return 0;
+}
+
+/* Segment with [addr, addr + len), NULL if there is none */
+static struct segment *find_segment(unsigned long long addr,
+				    unsigned long long len)
+{
+	unsigned int lo = 0, hi = nr_segs, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (addr < segs[mid].paddr)
+			hi = mid;
+		else if (addr >= segs[mid].paddr + segs[mid].size)
+			lo = mid + 1;
+		else
+			return len <= segs[mid].paddr + segs[mid].size - addr ?
+			       &segs[mid] : NULL;
+	}
+	return NULL;
+}
+
+static inline unsigned long long page_index(const struct segment *seg,
+					    unsigned long long addr)
+{
+	return seg->first + (addr - seg->paddr) / page_size;
+}
+
+static void mark_done(const struct segment *seg, unsigned long long pfn,
+		      unsigned long long nr)
+{
+	unsigned long long i = page_index(seg, pfn * page_size);
+	const unsigned int bits = 8 * sizeof(*done);
+
+	for (nr += i; i < nr; i++)
+		__sync_fetch_and_or(&done[i / bits], 1UL << (i % bits));
+}
+
+static inline bool is_done(const struct segment *seg, unsigned long long pfn)
+{
+	unsigned long long i = page_index(seg, pfn * page_size);
+	const unsigned int bits = 8 * sizeof(*done);
+
+	return done[i / bits] & (1UL << (i % bits));
+}
+
+/* Make the pages at [off, off + len) of the core file read as zeroes */
+static void punch_hole(off_t off, size_t len)
+{
+	static char zero[BUF_SIZE];
+	size_t n;
+
+	if (!fallocate(core_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       off, len))
+		return;
+	for (; len; len -= n, off += n) {
+		n = len < BUF_SIZE ? len : BUF_SIZE;
+		pwrite_full(core_fd, zero, n, off);
+	}
+}
+
+static int bad_chunk(struct stream *st, const struct memdump_chunk *c)
+{
+	fprintf(stderr, "stream %d: bad chunk (type %u, pfn %#llx, "
+		"%u pages, %u bytes)\n", st->index, c->type,
+		(unsigned long long)c->pfn, c->nr_pages, c->size);
+	return -1;
+}
+
+/* A corrupted payload only loses its pages, they are listed as missing */
+static bool check_crc(struct stream *st, const struct memdump_chunk *c,
+		      const void *payload)
+{
+	if (!(st->hdr.flags & MEMDUMP_F_CRC) || crc32(payload, c->size) ==
+	    c->crc)
+		return true;
+	fprintf(stderr, "stream %d: bad checksum at pfn %#llx\n", st->index,
+		(unsigned long long)c->pfn);
+	__sync_fetch_and_add(&bad_chunks, 1);
+	return false;
+}
+
+/*
+ * The pages of the span that are not in the bitmap are done already: in a
+ * delta dump they are the same as in the baseline, otherwise they read as
+ * zeroes, that they might not do in a core file being updated.
+ */
+static int recv_bitmap(struct stream *st, const struct memdump_chunk *c)
+{
+	const unsigned long long len = (unsigned long long)c->nr_pages *
+				       page_size;
+	const bool punch = update && !(st->hdr.flags & MEMDUMP_F_DELTA);
+	struct segment *seg;
+	unsigned int i, first;
+	bool set;
+
+	if (!c->nr_pages || c->nr_pages > MAX_BITMAP_PAGES ||
+	    c->size != (c->nr_pages + 7) / 8)
+		return bad_chunk(st, c);
+	seg = find_segment(c->pfn * page_size, len);
+	if (!seg)
+		return bad_chunk(st, c);
+	if (read_full(st, st->map, c->size))
+		return -1;
+	if (!check_crc(st, c, st->map))
+		return 0;
+	for (first = i = 0; i <= c->nr_pages; i++) {
+		set = i < c->nr_pages && (st->map[i / 8] >> (i % 8)) & 1;
+		if (i < c->nr_pages && !set)
+			continue;
+		if (i > first) {
+			mark_done(seg, c->pfn + first, i - first);
+			if (punch)
+				punch_hole(seg->offset + (c->pfn + first) *
+					   page_size - seg->paddr,
+					   (size_t)(i - first) * page_size);
+		}
+		first = i + 1;
+	}
+	return 0;
+}
+
+static int recv_pages(struct stream *st, const struct memdump_chunk *c)
+{
+	const size_t len = (size_t)c->nr_pages * page_size;
+	const unsigned long long addr = c->pfn * page_size;
+	struct segment *seg;
+	size_t out = len;
+	off_t off;
+
+	if (!c->nr_pages || c->nr_pages > MEMDUMP_CHUNK_PAGES ||
+	    c->size > len || (c->type == MEMDUMP_CHUNK_RAW && c->size != len))
+		return bad_chunk(st, c);
+	seg = find_segment(addr, len);
+	if (!seg)
+		return bad_chunk(st, c);
+	off = seg->offset + (addr - seg->paddr);
+	if (c->type == MEMDUMP_CHUNK_RAW && !(st->hdr.flags & MEMDUMP_F_CRC)) {
+		if (copy_to_core(st, len, off))
+			return -1;
+	} else if (c->type == MEMDUMP_CHUNK_RAW) {
+		if (read_full(st, st->buf, len))
+			return -1;
+		if (!check_crc(st, c, st->buf))
+			return 0;
+		pwrite_full(core_fd, st->buf, len, off);
+	} else {
+		if (read_full(st, st->zbuf, c->size))
+			return -1;
+		if (!check_crc(st, c, st->zbuf))
+			return 0;
+		if (lzo1x_decompress((unsigned char *)st->zbuf, c->size,
+				     (unsigned char *)st->buf, &out) ||
+		    out != len) {
+			fprintf(stderr, "stream %d: bad LZO chunk at pfn "
+				"%#llx\n", st->index,
+				(unsigned long long)c->pfn);
+			__sync_fetch_and_add(&bad_chunks, 1);
+			return 0;
+		}
+		pwrite_full(core_fd, st->buf, len, off);
+	}
+	mark_done(seg, c->pfn, c->nr_pages);
+	__sync_fetch_and_add(&ram_bytes, len);
+	return 0;
+}
+
+static void *stream_fn(void *arg)
+{
+	struct stream *st = arg;
+	struct memdump_chunk c;
+	int ret = 0;
+
+	while (!ret && !read_full(st, &c, sizeof(c))) {
+		if (c.magic != MEMDUMP_CHUNK_MAGIC) {
+			ret = bad_chunk(st, &c);
+			break;
+		}
+		switch (c.type) {
+		case MEMDUMP_CHUNK_RAW:
+		case MEMDUMP_CHUNK_LZO:
+			ret = recv_pages(st, &c);
+			break;
+		case MEMDUMP_CHUNK_BITMAP:
+			ret = recv_bitmap(st, &c);
+			break;
+		case MEMDUMP_CHUNK_END:
+			st->end = true;
+			return NULL;
+		default:
+			ret = bad_chunk(st, &c);
+		}
+	}
+	fprintf(stderr, "stream %d: truncated\n", st->index);
+	return NULL;
+}
+
+/* A raw stream: the segments back to back, until the connection is closed */
+static void *raw_fn(void *arg)
+{
+	struct stream *st = arg;
+	unsigned int i;
+
+	for (i = 0; i < nr_segs; i++) {
+		if (copy_to_core(st, segs[i].size, segs[i].offset)) {
+			fprintf(stderr, "stream %d: truncated\n", st->index);
+			return NULL;
+		}
+		__sync_fetch_and_add(&ram_bytes, segs[i].size);
+	}
+	st->end = true;
+	return NULL;
+}
+
+static void *progress_fn(void *arg)
+{
+	unsigned long long last = 0, bytes, t = now_ns(), t1;
+	const struct timespec second = { 1, 0 };
+
+	for (;;) {
+		nanosleep(&second, NULL);
+		bytes = rx_bytes;
+		t1 = now_ns();
+		fprintf(stderr, "\r%llu MB received, %.1f MB/s    ",
+			bytes / 1000000, (bytes - last) * 1E3 / (t1 - t));
+		last = bytes;
+		t = t1;
+	}
+	return NULL;
+}
+
+static int connect_to(const char *host)
+{
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *ai, *p;
+	char service[16];
+	int fd = -1, ret;
+
+	snprintf(service, sizeof(service), "%d", port);
+	ret = getaddrinfo(host, service, &hints, &ai);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+	for (p = ai; p; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd < 0)
+			continue;
+		/* Before connecting, to get a large window */
+		if (rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+					 sizeof(rcvbuf)) < 0)
+			fail("SO_RCVBUF");
+		if (!connect(fd, p->ai_addr, p->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (fd < 0)
+		fail("connect");
+	return fd;
+}
+
+static void send_request(int fd)
+{
+	struct memdump_request req = {
+		.magic		= MEMDUMP_REQUEST_MAGIC,
+		.version	= MEMDUMP_VERSION,
+		.nr_ranges	= nr_req,
+		.baseline	= baseline,
+	};
+
+	write_full(fd, &req, sizeof(req));
+	write_full(fd, req_ranges, nr_req * sizeof(*req_ranges));
+}
+
+static void read_header(struct stream *st)
+{
+	size_t len;
+
+	if (read_full(st, &st->hdr, sizeof(st->hdr)))
+		exit(EXIT_FAILURE);
+	if (st->hdr.magic != MEMDUMP_MAGIC) {
+		fprintf(stderr, "stream %d: not a memdump stream\n",
+			st->index);
+		exit(EXIT_FAILURE);
+	}
+	if (st->hdr.version != MEMDUMP_VERSION) {
+		fprintf(stderr, "stream %d: version %u, expected %u\n",
+			st->index, st->hdr.version, MEMDUMP_VERSION);
+		exit(EXIT_FAILURE);
+	}
+	if (st->hdr.nr_streams != nr_streams) {
+		fprintf(stderr, "the dump has %u streams, use -n %u\n",
+			st->hdr.nr_streams, st->hdr.nr_streams);
+		exit(EXIT_FAILURE);
+	}
+	len = st->hdr.nr_ranges * sizeof(*st->ranges);
+	st->ranges = xzalloc(len + 1);
+	if (read_full(st, st->ranges, len))
+		exit(EXIT_FAILURE);
+}
+
+/* The top level "System RAM" entries of /proc/iomem */
+static void read_iomem(void)
+{
+	unsigned long long start, end, first = 0;
+	char line[256], name[256];
+	FILE *f;
+
+	f = fopen(iomem, "r");
+	if (!f)
+		fail(iomem);
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == ' ' ||
+		    sscanf(line, "%llx-%llx : %255[^\n]", &start, &end,
+			   name) != 3 || strcmp(name, "System RAM"))
+			continue;
+		segs = realloc(segs, (nr_segs + 1) * sizeof(*segs));
+		if (!segs)
+			fail("realloc");
+		segs[nr_segs].paddr = start;
+		segs[nr_segs].size = end - start + 1;
+		segs[nr_segs].first = first;
+		first += (segs[nr_segs].size + page_size - 1) / page_size;
+		nr_segs++;
+	}
+	fclose(f);
+	if (!nr_segs) {
+		fprintf(stderr, "%s: no System RAM\n", iomem);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void layout_ranges(const struct memdump_range *ranges, unsigned int nr)
+{
+	unsigned long long first = 0;
+	unsigned int i;
+
+	segs = xzalloc(nr * sizeof(*segs) + 1);
+	for (i = 0; i < nr; i++) {
+		segs[i].paddr = ranges[i].start_pfn * page_size;
+		segs[i].size = ranges[i].nr_pages * page_size;
+		segs[i].first = first;
+		first += ranges[i].nr_pages;
+	}
+	nr_segs = nr;
+}
+
+/* Write the headers of a new core file, and place the segments */
+static void create_core(void)
+{
+	const bool is64 = mach->class == ELFCLASS64;
+	const size_t ehdr = is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+	const size_t phdr = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+	size_t len = ehdr + (nr_segs + 1) * phdr + sizeof(struct note);
+	unsigned long long off;
+	unsigned int i;
+	char *buf;
+
+	note_offset = ehdr + (nr_segs + 1) * phdr;
+	off = (len + page_size - 1) / page_size * page_size;
+	for (i = 0; i < nr_segs; i++) {
+		segs[i].offset = off;
+		off += segs[i].size;
+		if (!is64 && segs[i].paddr + segs[i].size > 1ULL << 32) {
+			fprintf(stderr, "RAM above 4 GB, use a 64-bit -m\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	buf = xzalloc(len);
+	memcpy(buf, ELFMAG, SELFMAG);
+	buf[EI_CLASS] = mach->class;
+	buf[EI_DATA] = ELFDATA2LSB;
+	buf[EI_VERSION] = EV_CURRENT;
+	if (is64) {
+		Elf64_Ehdr *eh = (Elf64_Ehdr *)buf;
+		Elf64_Phdr *ph = (Elf64_Phdr *)(buf + ehdr);
+
+		eh->e_type = ET_CORE;
+		eh->e_machine = mach->machine;
+		eh->e_version = EV_CURRENT;
+		eh->e_phoff = ehdr;
+		eh->e_ehsize = ehdr;
+		eh->e_phentsize = phdr;
+		eh->e_phnum = nr_segs + 1;
+		ph->p_type = PT_NOTE;
+		ph->p_offset = note_offset;
+		ph->p_filesz = sizeof(struct note);
+		for (i = 0, ph++; i < nr_segs; i++, ph++) {
+			ph->p_type = PT_LOAD;
+			ph->p_flags = PF_R | PF_W | PF_X;
+			ph->p_offset = segs[i].offset;
+			ph->p_paddr = segs[i].paddr;
+			ph->p_vaddr = segs[i].paddr + voffset;
+			ph->p_filesz = ph->p_memsz = segs[i].size;
+			ph->p_align = page_size;
+		}
+	} else {
+		Elf32_Ehdr *eh = (Elf32_Ehdr *)buf;
+		Elf32_Phdr *ph = (Elf32_Phdr *)(buf + ehdr);
+
+		eh->e_type = ET_CORE;
+		eh->e_machine = mach->machine;
+		eh->e_version = EV_CURRENT;
+		eh->e_phoff = ehdr;
+		eh->e_ehsize = ehdr;
+		eh->e_phentsize = phdr;
+		eh->e_phnum = nr_segs + 1;
+		ph->p_type = PT_NOTE;
+		ph->p_offset = note_offset;
+		ph->p_filesz = sizeof(struct note);
+		for (i = 0, ph++; i < nr_segs; i++, ph++) {
+			ph->p_type = PT_LOAD;
+			ph->p_flags = PF_R | PF_W | PF_X;
+			ph->p_offset = segs[i].offset;
+			ph->p_paddr = segs[i].paddr;
+			ph->p_vaddr = segs[i].paddr + voffset;
+			ph->p_filesz = ph->p_memsz = segs[i].size;
+			ph->p_align = page_size;
+		}
+	}
+	core_note.nhdr.n_namesz = sizeof(NOTE_NAME);
+	core_note.nhdr.n_descsz = 2 * sizeof(__u32);
+	core_note.nhdr.n_type = NOTE_TYPE;
+	memcpy(core_note.name, NOTE_NAME, sizeof(NOTE_NAME));
+	memcpy(buf + note_offset, &core_note, sizeof(core_note));
+	pwrite_full(core_fd, buf, len, 0);
+	free(buf);
+	/* Holes until the pages are received */
+	if (ftruncate(core_fd, off) < 0)
+		fail("ftruncate");
+}
+
+/* -u: the segments and the note of a core file written by memdump-recv */
+static void open_core(const char *name)
+{
+	unsigned long long first = 0;
+	unsigned char ident[EI_NIDENT];
+	Elf64_Ehdr eh;
+	Elf64_Phdr *ph;
+	Elf32_Ehdr eh32;
+	Elf32_Phdr ph32;
+	unsigned int i;
+
+	if (pread(core_fd, ident, sizeof(ident), 0) != sizeof(ident) ||
+	    memcmp(ident, ELFMAG, SELFMAG))
+		goto bad;
+	if (ident[EI_CLASS] == ELFCLASS64) {
+		if (pread(core_fd, &eh, sizeof(eh), 0) != sizeof(eh))
+			goto bad;
+		ph = xzalloc(eh.e_phnum * sizeof(*ph) + 1);
+		if (pread(core_fd, ph, eh.e_phnum * sizeof(*ph), eh.e_phoff) !=
+		    (ssize_t)(eh.e_phnum * sizeof(*ph)))
+			goto bad;
+	} else {
+		if (pread(core_fd, &eh32, sizeof(eh32), 0) != sizeof(eh32))
+			goto bad;
+		eh.e_phnum = eh32.e_phnum;
+		ph = xzalloc(eh.e_phnum * sizeof(*ph) + 1);
+		for (i = 0; i < eh.e_phnum; i++) {
+			if (pread(core_fd, &ph32, sizeof(ph32), eh32.e_phoff +
+				  i * sizeof(ph32)) != sizeof(ph32))
+				goto bad;
+			ph[i].p_type = ph32.p_type;
+			ph[i].p_offset = ph32.p_offset;
+			ph[i].p_paddr = ph32.p_paddr;
+			ph[i].p_filesz = ph32.p_filesz;
+		}
+	}
+	segs = xzalloc(eh.e_phnum * sizeof(*segs) + 1);
+	for (i = 0; i < eh.e_phnum; i++) {
+		if (ph[i].p_type == PT_NOTE) {
+			note_offset = ph[i].p_offset;
+			if (pread(core_fd, &core_note, sizeof(core_note),
+				  note_offset) != sizeof(core_note))
+				goto bad;
+			continue;
+		}
+		if (ph[i].p_type != PT_LOAD)
+			continue;
+		segs[nr_segs].paddr = ph[i].p_paddr;
+		segs[nr_segs].size = ph[i].p_filesz;
+		segs[nr_segs].offset = ph[i].p_offset;
+		segs[nr_segs].first = first;
+		first += (ph[i].p_filesz + page_size - 1) / page_size;
+		nr_segs++;
+	}
+	free(ph);
+	if (!note_offset || memcmp(core_note.name, NOTE_NAME,
+				   sizeof(NOTE_NAME)))
+		goto bad;
+	return;
+bad:
+	fprintf(stderr, "%s: not a core file of memdump-recv\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static void setup_core(const char *name)
+{
+	const struct memdump_header *hdr = &streams[0].hdr;
+	unsigned long long pages = 0;
+	unsigned int i;
+
+	core_fd = open(name, update ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC,
+		       0644);
+	if (core_fd < 0)
+		fail(name);
+	if (!raw && (hdr->flags & MEMDUMP_F_DELTA) && !update) {
+		fprintf(stderr, "delta dump over dump %u: update its core "
+			"file with -u\n", hdr->baseline);
+		exit(EXIT_FAILURE);
+	}
+	if (update) {
+		open_core(name);
+		if (!raw && (hdr->flags & MEMDUMP_F_DELTA) &&
+		    hdr->baseline != core_note.id) {
+			fprintf(stderr, "%s: core file of dump %u, the "
+				"baseline is %u\n", name, core_note.id,
+				hdr->baseline);
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; !raw && i < hdr->nr_ranges; i++)
+			if (!find_segment(streams[0].ranges[i].start_pfn *
+					  page_size,
+					  streams[0].ranges[i].nr_pages *
+					  page_size)) {
+				fprintf(stderr, "%s: the ranges don't match "
+					"the dump\n", name);
+				exit(EXIT_FAILURE);
+			}
+	} else {
+		if (!raw)
+			layout_ranges(streams[0].ranges, hdr->nr_ranges);
+		create_core();
+	}
+	for (i = 0; i < nr_segs; i++)
+		pages += (segs[i].size + page_size - 1) / page_size;
+	done = xzalloc((pages / 8 + sizeof(*done)) & ~(sizeof(*done) - 1));
+}
+
+/* Print the ranges of the dump that haven't been received, as -R wants */
+static unsigned long long report_missing(void)
+{
+	unsigned long long pfn, start, end, missing = 0;
+	const struct memdump_range *r;
+	struct segment *seg;
+	unsigned int i;
+	const char *sep = "";
+
+	for (i = 0; i < streams[0].hdr.nr_ranges; i++) {
+		r = &streams[0].ranges[i];
+		seg = find_segment(r->start_pfn * page_size,
+				   r->nr_pages * page_size);
+		end = r->start_pfn + r->nr_pages;
+		for (pfn = r->start_pfn; pfn < end; pfn++) {
+			if (is_done(seg, pfn))
+				continue;
+			for (start = pfn; pfn < end && !is_done(seg, pfn);)
+				pfn++;
+			if (!missing)
+				fprintf(stderr, "missing pages, get them with "
+					"-u -R ");
+			fprintf(stderr, "%s%#llx:%llu", sep, start,
+				pfn - start);
+			sep = ",";
+			missing += pfn - start;
+		}
+	}
+	if (missing)
+		fprintf(stderr, "\n");
+	return missing;
+}
+
+static void parse_ranges(char *arg)
+{
+	char *tok, *end;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (nr_req == MAX_REQUEST_RANGES) {
+			fprintf(stderr, "too many ranges\n");
+			exit(EXIT_FAILURE);
+		}
+		req_ranges[nr_req].start_pfn = strtoull(tok, &end, 0);
+		if (*end == ':')
+			req_ranges[nr_req].nr_pages = strtoull(end + 1, NULL, 0);
+		if (*end != ':' || !req_ranges[nr_req].nr_pages) {
+			fprintf(stderr, "bad range: %s\n", tok);
+			exit(EXIT_FAILURE);
+		}
+		nr_req++;
+	}
+}
+
+static const struct machine *parse_machine(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_MACHINES; i++)
+		if (!strcmp(machines[i].name, name))
+			return &machines[i];
+	fprintf(stderr, "unknown machine: %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr,
+		"%s [OPTIONS] HOST CORE\n"
+		"%s [OPTIONS] -f DUMP CORE\n"
+		"  -p PORT            port of the module (default: 4444)\n"
+		"  -n STREAMS         connections of a dump (default: 1)\n"
+		"  -f DUMP            read a dump written with path= (- for "
+		"stdin)\n"
+		"  -i IOMEM           /proc/iomem of the device, for a raw "
+		"stream\n"
+		"  -r                 send a request (module with requests=1)\n"
+		"  -R PFN:PAGES[,...] request these ranges only (implies -r)\n"
+		"  -b ID              request a delta over dump ID (implies "
+		"-r)\n"
+		"  -u                 write into the existing CORE\n"
+		"  -m MACHINE         of the core file (default: arm)\n"
+		"  -v OFFSET          virtual address of the RAM minus the "
+		"physical one\n"
+		"  -B SIZE            receive buffer (default: 4m, 0: "
+		"autotuning)\n"
+		"MACHINE:", prog, prog);
+	for (i = 0; i < NR_MACHINES; i++)
+		fprintf(stderr, " %s", machines[i].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t val = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		val <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		val <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		val <<= 10;
+	}
+	return val;
+}
+
+int main(int argc, char **argv)
+{
+	const struct memdump_header *hdr = &streams[0].hdr;
+	pthread_t progress;
+	unsigned long long start, ns, missing;
+	struct stream *st;
+	unsigned int i, incomplete = 0;
+	const char *core;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:n:f:i:rR:b:um:v:B:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'n':
+			nr_streams = atoi(optarg);
+			break;
+		case 'f':
+			input = optarg;
+			break;
+		case 'i':
+			iomem = optarg;
+			break;
+		case 'r':
+			request = true;
+			break;
+		case 'R':
+			parse_ranges(optarg);
+			request = true;
+			break;
+		case 'b':
+			baseline = strtoul(optarg, NULL, 0);
+			request = true;
+			break;
+		case 'u':
+			update = true;
+			break;
+		case 'm':
+			mach = parse_machine(optarg);
+			break;
+		case 'v':
+			voffset = strtoull(optarg, NULL, 0);
+			break;
+		case 'B':
+			rcvbuf = parse_size(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + (input ? 1 : 2) != argc || nr_streams < 1 ||
+	    nr_streams > MAX_STREAMS || (input && (nr_streams > 1 || request)))
+		usage(argv[0]);
+	core = argv[argc - 1];
+	crc_init();
+
+	for (i = 0; i < nr_streams; i++) {
+		st = &streams[i];
+		st->index = i;
+		if (!input)
+			st->fd = connect_to(argv[optind]);
+		else if (!strcmp(input, "-"))
+			st->fd = STDIN_FILENO;
+		else if ((st->fd = open(input, O_RDONLY)) < 0)
+			fail(input);
+		if (request)
+			send_request(st->fd);
+	}
+	/* A raw stream starts with the first page of RAM */
+	st = &streams[0];
+	if (read_full(st, st->peek, sizeof(st->peek)))
+		exit(EXIT_FAILURE);
+	st->nr_peek = sizeof(st->peek);
+	raw = memcmp(st->peek, &(__u32){ MEMDUMP_MAGIC }, sizeof(st->peek));
+	if (raw) {
+		if (!iomem || nr_streams > 1 || update) {
+			fprintf(stderr, "raw stream: give the /proc/iomem of "
+				"the device with -i, without -n or -u\n");
+			exit(EXIT_FAILURE);
+		}
+		read_iomem();
+	} else {
+		for (i = 0; i < nr_streams; i++)
+			read_header(&streams[i]);
+		page_size = hdr->page_size;
+		for (i = 1; i < nr_streams; i++)
+			if (streams[i].hdr.nr_ranges != hdr->nr_ranges ||
+			    memcmp(streams[i].ranges, st->ranges,
+				   hdr->nr_ranges * sizeof(*st->ranges))) {
+				fprintf(stderr, "the streams don't belong to "
+					"the same dump\n");
+				exit(EXIT_FAILURE);
+			}
+	}
+	setup_core(core);
+
+	start = now_ns();
+	if (pthread_create(&progress, NULL, progress_fn, NULL))
+		fail("pthread_create");
+	for (i = 0; i < nr_streams; i++) {
+		st = &streams[i];
+		st->buf = xzalloc(BUF_SIZE > MEMDUMP_CHUNK_PAGES * page_size ?
+				  BUF_SIZE : MEMDUMP_CHUNK_PAGES * page_size);
+		st->zbuf = xzalloc(MEMDUMP_CHUNK_PAGES * page_size);
+		st->map = xzalloc(MAX_BITMAP_PAGES / 8);
+		st->splice = !pipe(st->pipe);
+		if (st->splice)
+			fcntl(st->pipe[1], F_SETPIPE_SZ, BUF_SIZE);
+		if (pthread_create(&st->thread, NULL, raw ? raw_fn : stream_fn,
+				   st))
+			fail("pthread_create");
+	}
+	for (i = 0; i < nr_streams; i++) {
+		pthread_join(streams[i].thread, NULL);
+		incomplete += !streams[i].end;
+	}
+	ns = now_ns() - start;
+	pthread_cancel(progress);
+	pthread_join(progress, NULL);
+
+	fprintf(stderr, "\n%llu bytes received, %llu bytes of RAM, in %.3f s, "
+		"%.1f MB/s\n", rx_bytes, ram_bytes, ns / 1E9,
+		ns ? rx_bytes * 1E3 / ns : 0.0);
+	if (!raw)
+		fprintf(stderr, "dump %u (baseline %u), flags %#x, %u "
+			"streams\n", hdr->id, hdr->baseline, hdr->flags,
+			nr_streams);
+	if (bad_chunks)
+		fprintf(stderr, "%u bad chunks\n", bad_chunks);
+	missing = raw ? 0 : report_missing();
+	/* Only a complete dump can be the baseline of a delta dump */
+	if (!raw && !incomplete && !missing && !nr_req) {
+		core_note.id = hdr->id;
+		core_note.flags = hdr->flags;
+	} else {
+		core_note.id = 0;
+	}
+	pwrite_full(core_fd, &core_note, sizeof(core_note), note_offset);
+	if (fsync(core_fd) < 0)
+		fail("fsync");
+	close(core_fd);
+
+	return incomplete || missing ? EXIT_FAILURE : 0;
+}
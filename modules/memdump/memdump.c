@@ -3,10 +3,21 @@
 #include <linux/highmem.h>
 #include <linux/pfn.h>
 #include <linux/kthread.h>
+#include <linux/cpu.h>
+#include <linux/vmalloc.h>
+#include <linux/lzo.h>
+#include <linux/ktime.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/crc32.h>
+#include <linux/fs.h>
+#include <linux/sort.h>
 #include <net/sock.h>
 #include <net/tcp.h>
 #include <linux/wakelock.h>
 
+#include "memdump.h"
+
 #define DBG(fmt, args...)						\
 	do {								\
 		printk(KERN_INFO "[memdump] "fmt"\n", ## args);		\
@@ -20,28 +31,108 @@ static int tcp_port = 4444;
 module_param(tcp_port, int, 0644);
 MODULE_PARM_DESC(tcp_port, "Port used to send memory dump information");
 
+static char *compress = "none";
+module_param(compress, charp, 0444);
+MODULE_PARM_DESC(compress, "Compression of the dump: none (raw stream) or lzo");
+
+static bool sparse;
+module_param(sparse, bool, 0444);
+MODULE_PARM_DESC(sparse, "Send only the pages that are not zero-filled");
+
+static bool skip_free = true;
+module_param(skip_free, bool, 0644);
+MODULE_PARM_DESC(skip_free, "Sparse mode: skip the free pages too");
+
+static int sndbuf = 4 << 20;
+module_param(sndbuf, int, 0444);
+MODULE_PARM_DESC(sndbuf,
+	"Send buffer of the connections in bytes (0 = autotuning)");
+
+static int streams = 1;
+module_param(streams, int, 0444);
+MODULE_PARM_DESC(streams,
+	"Connections of a dump, sent in parallel from different CPUs");
+
+static bool delta;
+module_param(delta, bool, 0444);
+MODULE_PARM_DESC(delta, "Keep the fingerprints of the pages for delta dumps");
+
+static unsigned int delta_base;
+module_param(delta_base, uint, 0644);
+MODULE_PARM_DESC(delta_base,
+	"Send only the pages changed since the dump with this id (0 = all)");
+
+static bool requests;
+module_param(requests, bool, 0444);
+MODULE_PARM_DESC(requests,
+	"Connections start with a request of the ranges to dump");
+
+static bool checksum;
+module_param(checksum, bool, 0444);
+MODULE_PARM_DESC(checksum, "Checksum the chunks (always on with requests)");
+
+static char *path;
+module_param(path, charp, 0444);
+MODULE_PARM_DESC(path,
+	"Write a dump to this file or block device instead of serving TCP");
+
+static unsigned int rate;
+module_param(rate, uint, 0644);
+MODULE_PARM_DESC(rate, "Limit of a dump in MB/s, over all its streams "
+	"(0 = none)");
+
+static unsigned int max_load;
+module_param(max_load, uint, 0644);
+MODULE_PARM_DESC(max_load, "Back off while the other runnable tasks exceed "
+	"this percentage of the online CPUs (0 = never)");
+
+static int nice;
+module_param(nice, int, 0444);
+MODULE_PARM_DESC(nice, "Nice level of the dumper threads");
+
+static char *cpus;
+module_param(cpus, charp, 0444);
+MODULE_PARM_DESC(cpus, "CPUs of the dumper threads, like 0,2-3 (default: all)");
+
+static char *resources = SYSTEM_RAM_STRING;
+module_param(resources, charp, 0444);
+MODULE_PARM_DESC(resources,
+	"Top level iomem resources to dump, by name, separated by commas");
+
+static char *pfns;
+module_param(pfns, charp, 0444);
+MODULE_PARM_DESC(pfns,
+	"Dump only these ranges of pfns, like 0x80000-0x8ffff,... (default: all)");
+
+static char *page_types;
+module_param(page_types, charp, 0444);
+MODULE_PARM_DESC(page_types, "Types of the pages to dump: slab, anon, "
+	"pagecache, free, reserved, other, or -TYPE to skip some (default: all)");
+
+/* MEMDUMP_F_* flags of the framed stream */
+static int memdump_flags;
+static bool framed;
+
+static cpumask_var_t memdump_cpus;
+
 static struct socket *server;
-static struct socket *client;
 static struct wake_lock memdump_wake_lock;
 
+/* The system is kept awake only while a dump is running */
 static void memdump_wake_lock_start(void)
 {
-	wake_lock_init(&memdump_wake_lock, WAKE_LOCK_SUSPEND,
-		       "memdump_wake_lock");
 	wake_lock(&memdump_wake_lock);
 }
 
 static void memdump_wake_lock_stop(void)
 {
 	wake_unlock(&memdump_wake_lock);
-	wake_lock_destroy(&memdump_wake_lock);
 }
 
 static int setup_tcp(void)
 {
 	struct sockaddr_in saddr = {};
 	mm_segment_t fs;
-	int buffersize = PAGE_SIZE;
 	int ret;
 
 	ret = sock_create_kern(AF_INET, SOCK_STREAM, IPPROTO_TCP, &server);
@@ -54,15 +145,22 @@ static int setup_tcp(void)
 	saddr.sin_port = htons(tcp_port);
 	saddr.sin_addr.s_addr = INADDR_ANY;
 
-	fs = get_fs();
-	set_fs(KERNEL_DS);
-	ret = sock_setsockopt(server, SOL_SOCKET, SO_SNDBUF,
-			(void *)&buffersize, sizeof(buffersize));
-	set_fs(fs);
+	/*
+	 * Inherited by the accepted connections. SO_SNDBUFFORCE isn't capped
+	 * by net.core.wmem_max, that is way too small to keep a fast link
+	 * busy.
+	 */
+	if (sndbuf) {
+		fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = sock_setsockopt(server, SOL_SOCKET, SO_SNDBUFFORCE,
+				(void *)&sndbuf, sizeof(sndbuf));
+		set_fs(fs);
 
-	if (unlikely(ret < 0)) {
-		DBG("error setting buffsize");
-		goto out_err;
+		if (unlikely(ret < 0)) {
+			DBG("error setting buffsize");
+			goto out_err;
+		}
 	}
 
 	ret = server->ops->bind(server, (struct sockaddr *)&saddr,
@@ -72,17 +170,11 @@ static int setup_tcp(void)
 		goto out_err;
 	}
 
-	ret = server->ops->listen(server, 1);
+	ret = server->ops->listen(server, streams);
 	if (unlikely(ret < 0)) {
 		DBG("error listening on socket");
 		goto out_err;
 	}
-
-	ret = sock_create_kern(PF_INET, SOCK_STREAM, IPPROTO_TCP, &client);
-	if (ret < 0) {
-		DBG("error creating accept socket");
-		goto out_err;
-	}
 out:
 	return ret;
 
@@ -93,67 +185,1240 @@ out_err:
 	goto out;
 }
 
-static int dump_memory_range_tcp(struct resource *res)
+/* A resource listed in resources= */
+static bool memdump_is_ram(struct resource *res)
 {
-	mm_segment_t fs;
-	resource_size_t i, len;
-	struct page *p;
+	const char *p = resources, *end;
+	size_t len;
+
+	if (!res->name)
+		return false;
+	for (;;) {
+		end = strchr(p, ',');
+		len = end ? end - p : strlen(p);
+		if (!strncmp(res->name, p, len) && !res->name[len])
+			return true;
+		if (!end)
+			return false;
+		p = end + 1;
+	}
+}
+
+/*
+ * Filters: pfns= and page_types= leave out parts of the RAM. The pages that
+ * are left out within a range are cleared in the bitmaps, as the ones of a
+ * sparse dump, and the header has MEMDUMP_F_FILTERED.
+ */
+enum {
+	MEMDUMP_PAGE_SLAB,
+	MEMDUMP_PAGE_ANON,
+	MEMDUMP_PAGE_CACHE,
+	MEMDUMP_PAGE_FREE,
+	MEMDUMP_PAGE_RESERVED,
+	MEMDUMP_PAGE_OTHER,	/* any other kernel page: page tables, ... */
+	MEMDUMP_NR_PAGE_TYPES,
+};
+
+#define MEMDUMP_ALL_PAGE_TYPES	((1U << MEMDUMP_NR_PAGE_TYPES) - 1)
+#define MEMDUMP_MAX_PFN_RANGES	64
+
+static const char * const memdump_page_type_names[] = {
+	[MEMDUMP_PAGE_SLAB]	= "slab",
+	[MEMDUMP_PAGE_ANON]	= "anon",
+	[MEMDUMP_PAGE_CACHE]	= "pagecache",
+	[MEMDUMP_PAGE_FREE]	= "free",
+	[MEMDUMP_PAGE_RESERVED]	= "reserved",
+	[MEMDUMP_PAGE_OTHER]	= "other",
+};
+
+static unsigned int memdump_page_types = MEMDUMP_ALL_PAGE_TYPES;
+static struct memdump_range memdump_pfns[MEMDUMP_MAX_PFN_RANGES];
+static unsigned int memdump_nr_pfns;
+
+/* A page of the RAM, @free if it's in a free block of the buddy allocator */
+static int memdump_page_type(struct page *page, bool free)
+{
+	if (free)
+		return MEMDUMP_PAGE_FREE;
+	if (PageReserved(page))
+		return MEMDUMP_PAGE_RESERVED;
+	/* The flags of slabs and of huge pages are on the first page */
+	page = compound_head(page);
+	if (PageSlab(page))
+		return MEMDUMP_PAGE_SLAB;
+	if (PageAnon(page) || PageSwapCache(page))
+		return MEMDUMP_PAGE_ANON;
+	if (page->mapping)
+		return MEMDUMP_PAGE_CACHE;
+	return MEMDUMP_PAGE_OTHER;
+}
+
+static int __init memdump_parse_page_types(void)
+{
+	unsigned int include = 0, exclude = 0, *mask;
+	char *buf, *p, *tok;
+	int i, ret = 0;
+
+	buf = p = kstrdup(page_types, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	while (!ret && (tok = strsep(&p, ","))) {
+		mask = &include;
+		if (*tok == '-') {
+			mask = &exclude;
+			tok++;
+		}
+		for (i = 0; i < MEMDUMP_NR_PAGE_TYPES; i++)
+			if (!strcmp(tok, memdump_page_type_names[i]))
+				break;
+		if (i == MEMDUMP_NR_PAGE_TYPES)
+			ret = -EINVAL;
+		else
+			*mask |= 1U << i;
+	}
+	kfree(buf);
+	memdump_page_types = (include ?: MEMDUMP_ALL_PAGE_TYPES) & ~exclude;
+
+	return ret;
+}
+
+static int memdump_cmp_range(const void *a, const void *b)
+{
+	const struct memdump_range *x = a, *y = b;
+
+	if (x->start_pfn != y->start_pfn)
+		return x->start_pfn < y->start_pfn ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort ranges and merge the ones that overlap, so that they can be clipped
+ * to the RAM in order: return their new number.
+ */
+static unsigned int memdump_sort_ranges(struct memdump_range *r,
+					unsigned int nr)
+{
+	unsigned int i, n = 0;
+	u64 end;
+
+	sort(r, nr, sizeof(*r), memdump_cmp_range, NULL);
+	for (i = 0; i < nr; i++) {
+		if (!r[i].nr_pages)
+			continue;
+		if (n && r[i].start_pfn <= r[n - 1].start_pfn +
+					   r[n - 1].nr_pages) {
+			end = max(r[n - 1].start_pfn + r[n - 1].nr_pages,
+				  r[i].start_pfn + r[i].nr_pages);
+			r[n - 1].nr_pages = end - r[n - 1].start_pfn;
+			continue;
+		}
+		r[n++] = r[i];
+	}
+	return n;
+}
+
+static int __init memdump_parse_pfns(void)
+{
+	char *buf, *p, *tok;
+	long long start, end;
+	int ret = 0;
+
+	buf = p = kstrdup(pfns, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	while (!ret && (tok = strsep(&p, ","))) {
+		if (memdump_nr_pfns == MEMDUMP_MAX_PFN_RANGES ||
+				sscanf(tok, "%lli-%lli", &start, &end) != 2 ||
+				start < 0 || end < start) {
+			ret = -EINVAL;
+			break;
+		}
+		memdump_pfns[memdump_nr_pfns].start_pfn = start;
+		memdump_pfns[memdump_nr_pfns].nr_pages = end - start + 1;
+		memdump_nr_pfns++;
+	}
+	kfree(buf);
+	memdump_nr_pfns = memdump_sort_ranges(memdump_pfns, memdump_nr_pfns);
+
+	return ret;
+}
+
+/*
+ * Everything but the end of a dump is sent with MSG_MORE: the socket only
+ * pushes full segments, whatever the size of the single sends.
+ */
+static int memdump_send(struct socket *sock, struct kvec *vec, int nr,
+			size_t len, int flags)
+{
+	struct msghdr msg = { .msg_flags = flags | MSG_NOSIGNAL };
+	int ret;
+
+	ret = kernel_sendmsg(sock, &msg, vec, nr, len);
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EPIPE;
+}
+
+/*
+ * Hand the first @len bytes of a page to the socket without copying them.
+ * The network stack takes its own reference, so the page must be pinned:
+ * free pages and tail pages, which have no references of their own, are
+ * copied instead. A page may still change before it goes out, but so may
+ * any page of a running system.
+ */
+static int memdump_send_page(struct socket *sock, struct page *page,
+			     size_t len, int flags)
+{
+	struct kvec vec;
+	int ret;
+
+	if (!get_page_unless_zero(page)) {
+		vec.iov_base = kmap(page);
+		vec.iov_len = len;
+		ret = memdump_send(sock, &vec, 1, len, flags);
+		kunmap(page);
+		return ret;
+	}
+	ret = kernel_sendpage(sock, page, 0, len, flags | MSG_NOSIGNAL);
+	put_page(page);
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EPIPE;
+}
+
+/*
+ * Throttling: with rate=N a dump sends at most N MB/s, each of its streams a
+ * share of it, and with max_load=P it backs off, for longer and longer up to
+ * MEMDUMP_BACKOFF_MAX ms, while the tasks that are runnable besides the
+ * dumper exceed P% of the online CPUs. Both can be changed during a dump.
+ * A stream checks them after each chunk of pages.
+ */
+#define MEMDUMP_BACKOFF_MIN	10
+#define MEMDUMP_BACKOFF_MAX	1000
+
+struct memdump_throttle {
+	unsigned int rate;	/* that start and base refer to */
+	ktime_t start;
+	u64 base;		/* bytes sent at start */
+	unsigned int backoff;	/* ms */
+};
+
+static bool memdump_busy(unsigned int nr_streams)
+{
+	unsigned int limit = ACCESS_ONCE(max_load);
+	unsigned long others = nr_running();
+
+	if (!limit)
+		return false;
+	/* The workers of the dump are runnable too */
+	others -= min_t(unsigned long, others, nr_streams);
+	return others * 100 > (unsigned long)num_online_cpus() * limit;
+}
+
+/*
+ * Return how long a stream that has sent @bytes so far must pause, in ms,
+ * to respect the limits.
+ */
+static unsigned int memdump_throttle(struct memdump_throttle *t, u64 bytes,
+				     unsigned int nr_streams)
+{
+	unsigned int limit = ACCESS_ONCE(rate);
+	ktime_t now = ktime_get();
+	s64 ahead = 0;
+
+	if (limit != t->rate) {
+		t->rate = limit;
+		t->start = now;
+		t->base = bytes;
+	}
+	if (limit) {
+		/* N MB/s is N bytes/us, shared by the streams */
+		ahead = div64_u64((bytes - t->base) * nr_streams, limit) -
+			ktime_us_delta(now, t->start);
+	}
+	if (memdump_busy(nr_streams))
+		t->backoff = clamp_t(unsigned int, t->backoff * 2,
+				     MEMDUMP_BACKOFF_MIN, MEMDUMP_BACKOFF_MAX);
+	else
+		t->backoff = 0;
+
+	return max_t(s64, div_s64(ahead, USEC_PER_MSEC), t->backoff);
+}
+
+/* Sleep @ms, a bit at a time so that a dump can be stopped meanwhile */
+static void memdump_sleep(unsigned int ms, const bool *abort)
+{
+	unsigned int n;
+
+	while (ms && !(abort && ACCESS_ONCE(*abort)) &&
+			!fatal_signal_pending(current)) {
+		n = min(ms, 100U);
+		msleep_interruptible(n);
+		ms -= n;
+	}
+}
+
+/*
+ * Framed mode: a header with the list of the RAM ranges, then the pages in
+ * chunks of MEMDUMP_CHUNK_PAGES, see memdump.h. Each chunk is compressed as
+ * a whole and sent as it is when that doesn't make it any smaller.
+ *
+ * In sparse mode each span of pages is scanned first and the bitmap of the
+ * pages worth sending goes before them, so that the size of the dump follows
+ * the memory in use rather than the memory installed.
+ *
+ * A dump is made of one or more streams (connections), each served by a
+ * worker bound to its own CPU: the workers take spans of MEMDUMP_SPAN_PAGES
+ * from a shared cursor until all the ranges are done, so that a slow stream
+ * doesn't hold back the others. Every stream is self-describing and every
+ * chunk carries its pfn, the receiver merges them in any order.
+ */
+#define MEMDUMP_MAX_STREAMS	64
+#define MEMDUMP_SPAN_PAGES	32768UL
+#define MEMDUMP_CHUNK_SIZE	(MEMDUMP_CHUNK_PAGES * PAGE_SIZE)
+#define MEMDUMP_MAX_REQUEST_RANGES	4096
+#define MEMDUMP_REQUEST_TIMEOUT		(30 * HZ)
+#define MEMDUMP_WBUF_SIZE	(1UL << 20)
+
+/* A dump, shared by its streams */
+struct memdump_job {
+	struct memdump_range *ranges;
+	unsigned int nr_ranges;
+	unsigned int nr_streams;
+	int flags;			/* MEMDUMP_F_* of this dump */
+	u32 id;				/* see memdump_fp */
+	u32 baseline;			/* delta dumps: id of the previous one */
+	bool partial;			/* only the ranges of a request */
+	spinlock_t lock;		/* protects the cursor and the totals */
+	unsigned int cur;		/* range of next_pfn */
+	unsigned long next_pfn;		/* first page of the next span */
+	u64 raw_bytes;			/* RAM dumped */
+	u64 sent_bytes;			/* bytes on the wire */
+	unsigned long skipped;		/* pages not sent */
+	int error;			/* first error of a stream */
+	bool abort;			/* stop all the streams */
+	atomic_t active;		/* running workers */
+	wait_queue_head_t wait;
+};
+
+/* A connection of a dump, or a local file, and its worker */
+struct memdump_stream {
+	struct memdump_job *job;
+	struct socket *sock;
+	struct file *file;	/* path=: instead of sock */
+	loff_t pos;
+	void *wbuf;		/* file: data not written yet */
+	size_t wlen;
+	struct task_struct *task;
+	unsigned int index;
+	void *buf;		/* pages of the current chunk */
+	void *zbuf;		/* the chunk, compressed */
+	void *wrkmem;		/* LZO working memory */
+	unsigned long *map;	/* pages of the current span to send */
+	struct memdump_throttle throttle;
+	u64 raw_bytes;
+	u64 sent_bytes;
+	unsigned long skipped;
+};
+
+static void memdump_stream_free(struct memdump_stream *st)
+{
+	vfree(st->buf);
+	vfree(st->zbuf);
+	vfree(st->wrkmem);
+	vfree(st->map);
+	vfree(st->wbuf);
+}
+
+static int memdump_stream_init(struct memdump_stream *st, int node)
+{
+	st->buf = vmalloc_node(MEMDUMP_CHUNK_SIZE, node);
+	if (!st->buf)
+		goto out_err;
+	if (st->job->flags & MEMDUMP_F_LZO) {
+		st->zbuf = vmalloc_node(lzo1x_worst_compress(MEMDUMP_CHUNK_SIZE),
+					node);
+		st->wrkmem = vmalloc_node(LZO1X_1_MEM_COMPRESS, node);
+		if (!st->zbuf || !st->wrkmem)
+			goto out_err;
+	}
+	if (st->job->flags & MEMDUMP_F_SPARSE) {
+		st->map = vmalloc_node(BITS_TO_LONGS(MEMDUMP_SPAN_PAGES) *
+				       sizeof(long), node);
+		if (!st->map)
+			goto out_err;
+	}
+	if (st->file) {
+		st->wbuf = vmalloc_node(MEMDUMP_WBUF_SIZE, node);
+		if (!st->wbuf)
+			goto out_err;
+	}
+	return 0;
+
+out_err:
+	memdump_stream_free(st);
+	return -ENOMEM;
+}
+
+/*
+ * Delta dumps: with delta=1 every dump stores a 32-bit hash of each page in
+ * memdump_fp and gets an id, that a later dump can name as its baseline
+ * (delta_base, or the baseline of a request) to send only the pages whose
+ * hash has changed since then.
+ * The bitmaps of a delta dump are its manifest: the pages they don't list
+ * are the same as in the baseline, unless the hash of a change collides.
+ *
+ * The table only holds the fingerprints of the last dump, and only when it
+ * was complete: memdump_fp_id is 0 while a dump is updating it and after
+ * one has failed, the next dump is a full one. Partial dumps (the ranges of
+ * a request, a resumed dump) compare the pages with the baseline but don't
+ * store anything, they can't be the baseline of another dump.
+ */
+static u32 *memdump_fp;
+static unsigned long memdump_fp_start, memdump_fp_nr;
+static u32 memdump_fp_id;
+static u32 memdump_fp_next_id;
+
+static int memdump_fp_init(void)
+{
+	unsigned long start = ULONG_MAX, end = 0;
+	struct resource *p;
+
+	for (p = iomem_resource.child; p; p = p->sibling) {
+		if (!memdump_is_ram(p))
+			continue;
+		start = min_t(unsigned long, start, PFN_DOWN(p->start));
+		end = max_t(unsigned long, end, PFN_DOWN(p->end) + 1);
+	}
+	if (start >= end)
+		return -ENODEV;
+	memdump_fp = vzalloc((end - start) * sizeof(*memdump_fp));
+	if (!memdump_fp)
+		return -ENOMEM;
+	memdump_fp_start = start;
+	memdump_fp_nr = end - start;
+	/* Don't take the ids of a previous load of the module for ours */
+	memdump_fp_next_id = get_random_int();
+
+	return 0;
+}
+
+/*
+ * Compare the fingerprint of a page (NULL if there is none) with the stored
+ * one, true if it has changed, and store it with @store.
+ */
+static bool memdump_fp_update(unsigned long pfn, struct page *page,
+			      bool store)
+{
+	u32 fp = 0, *slot;
 	void *v;
-	long s;
-	struct iovec iov;
-	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	if (pfn < memdump_fp_start || pfn - memdump_fp_start >= memdump_fp_nr)
+		return true;
+	if (page) {
+		v = kmap_atomic(page);
+		fp = jhash2(v, PAGE_SIZE / sizeof(u32), 0);
+		kunmap_atomic(v);
+	}
+	slot = &memdump_fp[pfn - memdump_fp_start];
+	if (*slot == fp)
+		return false;
+	if (store)
+		*slot = fp;
+	return true;
+}
+
+/* Called right before the workers start: the table is going to change */
+static void memdump_fp_begin(struct memdump_job *job, u32 baseline)
+{
+	if (!memdump_fp)
+		return;
+	if (baseline && baseline == memdump_fp_id) {
+		job->baseline = baseline;
+		job->flags |= MEMDUMP_F_DELTA;
+	}
+	if (job->partial)
+		return;
+	if (!++memdump_fp_next_id)
+		memdump_fp_next_id++;
+	job->id = memdump_fp_next_id;
+	memdump_fp_id = 0;
+}
+
+static void memdump_fp_end(struct memdump_job *job, int error)
+{
+	if (memdump_fp && !job->partial && !error)
+		memdump_fp_id = job->id;
+}
+
+static inline bool memdump_stopped(struct memdump_stream *st)
+{
+	return ACCESS_ONCE(st->job->abort) || fatal_signal_pending(current);
+}
+
+/*
+ * Clip sorted ranges (see memdump_sort_ranges()) to @ram: store the result
+ * in @out, if not NULL, and return the number of ranges.
+ */
+static unsigned int memdump_clip(const struct memdump_range *ram,
+				 unsigned int nr_ram,
+				 const struct memdump_range *want,
+				 unsigned int nr_want, struct memdump_range *out)
+{
+	unsigned int i, j, n = 0;
+	u64 start, end, want_end;
+
+	for (j = 0; j < nr_ram; j++) {
+		for (i = 0; i < nr_want; i++) {
+			want_end = want[i].start_pfn + want[i].nr_pages;
+			if (want_end < want[i].start_pfn)
+				want_end = ~0ULL;
+			start = max(want[i].start_pfn, ram[j].start_pfn);
+			end = min(want_end,
+				  ram[j].start_pfn + ram[j].nr_pages);
+			if (start >= end)
+				continue;
+			if (out) {
+				out[n].start_pfn = start;
+				out[n].nr_pages = end - start;
+			}
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Restrict the ranges of a job to the sorted ranges @want */
+static int memdump_job_clip(struct memdump_job *job,
+			    const struct memdump_range *want,
+			    unsigned int nr_want)
+{
+	struct memdump_range *ram = job->ranges;
+	unsigned int nr;
+
+	nr = memdump_clip(ram, job->nr_ranges, want, nr_want, NULL);
+	job->ranges = kcalloc(nr, sizeof(*job->ranges), GFP_KERNEL);
+	if (!job->ranges) {
+		job->ranges = ram;
+		return -ENOMEM;
+	}
+	memdump_clip(ram, job->nr_ranges, want, nr_want, job->ranges);
+	kfree(ram);
+	job->nr_ranges = nr;
+	job->partial = true;
+
+	return 0;
+}
+
+/*
+ * Snapshot of the ranges of resources=, in pages, or of the parts of them
+ * within pfns= and requested by the client (@want, sorted).
+ */
+static int memdump_job_init(struct memdump_job *job, unsigned int nr_streams,
+			    const struct memdump_range *want,
+			    unsigned int nr_want)
+{
+	struct resource *p;
+	unsigned int i = 0;
 	int ret = 0;
 
+	memset(job, 0, sizeof(*job));
+	for (p = iomem_resource.child; p; p = p->sibling)
+		if (memdump_is_ram(p))
+			job->nr_ranges++;
+	job->ranges = kcalloc(job->nr_ranges, sizeof(*job->ranges),
+			      GFP_KERNEL);
+	if (!job->ranges)
+		return -ENOMEM;
+	for (p = iomem_resource.child; p && i < job->nr_ranges;
+			p = p->sibling) {
+		if (!memdump_is_ram(p))
+			continue;
+		job->ranges[i].start_pfn = PFN_DOWN(p->start);
+		job->ranges[i].nr_pages = PFN_DOWN(p->end) -
+					  job->ranges[i].start_pfn + 1;
+		i++;
+	}
+	job->nr_ranges = i;
+	if (memdump_nr_pfns)
+		ret = memdump_job_clip(job, memdump_pfns, memdump_nr_pfns);
+	if (!ret && nr_want)
+		ret = memdump_job_clip(job, want, nr_want);
+	if (ret) {
+		kfree(job->ranges);
+		return ret;
+	}
+	job->nr_streams = nr_streams;
+	job->flags = memdump_flags;
+	/* The fingerprints are computed by the scan of the spans */
+	if (memdump_fp)
+		job->flags |= MEMDUMP_F_SPARSE;
+	/* Not the whole RAM: it can't be the baseline of a delta dump */
+	if (job->flags & MEMDUMP_F_FILTERED)
+		job->partial = true;
+	if (job->nr_ranges)
+		job->next_pfn = job->ranges[0].start_pfn;
+	spin_lock_init(&job->lock);
+	init_waitqueue_head(&job->wait);
+
+	return 0;
+}
+
+/* Hand out the next span of pages to dump, false when there are no more */
+static bool memdump_next_span(struct memdump_job *job, unsigned long *pfn,
+			      unsigned long *nr)
+{
+	struct memdump_range *r;
+	bool found = false;
+
+	spin_lock(&job->lock);
+	while (job->cur < job->nr_ranges) {
+		r = &job->ranges[job->cur];
+		if (job->next_pfn < r->start_pfn + r->nr_pages) {
+			*pfn = job->next_pfn;
+			*nr = min_t(unsigned long, MEMDUMP_SPAN_PAGES,
+				    r->start_pfn + r->nr_pages - *pfn);
+			job->next_pfn += *nr;
+			found = true;
+			break;
+		}
+		if (++job->cur < job->nr_ranges)
+			job->next_pfn = job->ranges[job->cur].start_pfn;
+	}
+	spin_unlock(&job->lock);
+
+	return found;
+}
+
+/*
+ * Local sink (path=): the data of a stream is gathered in wbuf and written
+ * MEMDUMP_WBUF_SIZE at a time, so that the file or the block device only
+ * sees large sequential writes.
+ */
+static int memdump_flush(struct memdump_stream *st)
+{
+	mm_segment_t fs;
+	ssize_t ret;
+
+	if (!st->wlen)
+		return 0;
 	fs = get_fs();
 	set_fs(KERNEL_DS);
-	for (i = res->start; i <= res->end; i += PAGE_SIZE) {
-		p = pfn_to_page((i) >> PAGE_SHIFT);
-		len = min_t(size_t, PAGE_SIZE, (size_t) (res->end - i + 1));
+	ret = vfs_write(st->file, (const char __user *)st->wbuf, st->wlen,
+			&st->pos);
+	set_fs(fs);
+	if (ret < 0)
+		return ret;
+	if (ret != st->wlen)
+		return -EIO;
+	st->wlen = 0;
+	return 0;
+}
 
-		v = kmap(p);
-		if (unlikely(!v)) {
-			ret = -ENOMEM;
-			break;
+static int memdump_write(struct memdump_stream *st, const void *buf,
+			 size_t len)
+{
+	size_t n;
+	int ret;
+
+	while (len) {
+		n = min_t(size_t, len, MEMDUMP_WBUF_SIZE - st->wlen);
+		memcpy(st->wbuf + st->wlen, buf, n);
+		st->wlen += n;
+		buf += n;
+		len -= n;
+		if (st->wlen == MEMDUMP_WBUF_SIZE) {
+			ret = memdump_flush(st);
+			if (unlikely(ret))
+				return ret;
 		}
-		iov.iov_base = v;
-		iov.iov_len = len;
+	}
+	return 0;
+}
 
-		s = sock_sendmsg(client, &msg, len);
+/*
+ * Hand data to the sink of a stream: the connection, or the file, where
+ * the end of the dump (no MSG_MORE) flushes what is left.
+ */
+static int memdump_emit(struct memdump_stream *st, struct kvec *vec, int nr,
+			size_t len, int flags)
+{
+	int i, ret = 0;
 
-		kunmap(p);
+	if (!st->file)
+		return memdump_send(st->sock, vec, nr, len, flags);
+	for (i = 0; !ret && i < nr; i++)
+		ret = memdump_write(st, vec[i].iov_base, vec[i].iov_len);
+	if (!ret && !(flags & MSG_MORE))
+		ret = memdump_flush(st);
+	return ret;
+}
 
-		if (s != len) {
-			DBG("error sending page");
-			ret = s;
+static int memdump_emit_page(struct memdump_stream *st, struct page *page,
+			     size_t len, int flags)
+{
+	void *v;
+	int ret;
+
+	if (!st->file)
+		return memdump_send_page(st->sock, page, len, flags);
+	v = kmap(page);
+	ret = memdump_write(st, v, len);
+	kunmap(page);
+	return ret;
+}
+
+static int memdump_send_header(struct memdump_stream *st)
+{
+	struct memdump_job *job = st->job;
+	struct memdump_header hdr = {
+		.magic		= MEMDUMP_MAGIC,
+		.version	= MEMDUMP_VERSION,
+		.flags		= job->flags,
+		.page_size	= PAGE_SIZE,
+		.nr_ranges	= job->nr_ranges,
+		.stream		= st->index,
+		.nr_streams	= job->nr_streams,
+		.id		= job->id,
+		.baseline	= job->baseline,
+	};
+	struct kvec vec[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = job->ranges,
+		  .iov_len = job->nr_ranges * sizeof(*job->ranges) },
+	};
+	size_t len = vec[0].iov_len + vec[1].iov_len;
+	int ret;
+
+	ret = memdump_emit(st, vec, 2, len, MSG_MORE);
+	if (likely(!ret))
+		st->sent_bytes += len;
+	return ret;
+}
+
+/* Send a chunk header, and its payload unless the caller sends it itself */
+static int memdump_send_frame(struct memdump_stream *st,
+			      struct memdump_chunk *chunk, void *payload)
+{
+	struct kvec vec[2] = {
+		{ .iov_base = chunk, .iov_len = sizeof(*chunk) },
+		{ .iov_base = payload, .iov_len = chunk->size },
+	};
+	size_t len = sizeof(*chunk) + (payload ? chunk->size : 0);
+	int ret;
+
+	chunk->magic = MEMDUMP_CHUNK_MAGIC;
+	if (payload && (st->job->flags & MEMDUMP_F_CRC))
+		chunk->crc = crc32_le(~0, payload, chunk->size) ^ ~0;
+	ret = memdump_emit(st, vec, payload ? 2 : 1, len,
+			   chunk->type == MEMDUMP_CHUNK_END ? 0 : MSG_MORE);
+	if (likely(!ret))
+		st->sent_bytes += len;
+	return ret;
+}
+
+static int memdump_send_chunk(struct memdump_stream *st, unsigned long pfn,
+			      unsigned int nr_pages)
+{
+	struct memdump_chunk chunk = {
+		.type		= MEMDUMP_CHUNK_RAW,
+		.pfn		= pfn,
+		.nr_pages	= nr_pages,
+		.size		= nr_pages * PAGE_SIZE,
+	};
+	void *payload = st->buf;
+	unsigned int i;
+	size_t zlen;
+	void *v;
+	int ret;
+
+	/*
+	 * The checksum must match what goes out: then the pages are copied,
+	 * they could change between the checksum and the transmission.
+	 */
+	if (!(st->job->flags & (MEMDUMP_F_LZO | MEMDUMP_F_CRC))) {
+		/* The header, then the pages as they are */
+		ret = memdump_send_frame(st, &chunk, NULL);
+		for (i = 0; !ret && i < nr_pages; i++)
+			ret = memdump_emit_page(st, pfn_to_page(pfn + i),
+						PAGE_SIZE, MSG_MORE);
+		if (likely(!ret)) {
+			st->raw_bytes += chunk.size;
+			st->sent_bytes += chunk.size;
+		}
+		return ret;
+	}
+	for (i = 0; i < nr_pages; i++) {
+		v = kmap(pfn_to_page(pfn + i));
+		memcpy(st->buf + i * PAGE_SIZE, v, PAGE_SIZE);
+		kunmap(pfn_to_page(pfn + i));
+	}
+	if (st->job->flags & MEMDUMP_F_LZO) {
+		ret = lzo1x_1_compress(st->buf, chunk.size, st->zbuf, &zlen,
+				       st->wrkmem);
+		if (ret == LZO_E_OK && zlen < chunk.size) {
+			chunk.type = MEMDUMP_CHUNK_LZO;
+			chunk.size = zlen;
+			payload = st->zbuf;
+		}
+	}
+	ret = memdump_send_frame(st, &chunk, payload);
+	if (likely(!ret))
+		st->raw_bytes += nr_pages * PAGE_SIZE;
+	return ret;
+}
+
+static int memdump_send_end(struct memdump_stream *st)
+{
+	struct memdump_chunk chunk = {
+		.type		= MEMDUMP_CHUNK_END,
+	};
+
+	return memdump_send_frame(st, &chunk, NULL);
+}
+
+/* Send the pages in [pfn, end), MEMDUMP_CHUNK_PAGES at a time */
+static int memdump_send_pages(struct memdump_stream *st, unsigned long pfn,
+			      unsigned long end)
+{
+	unsigned int nr;
+	int ret;
+
+	for (; pfn < end; pfn += nr) {
+		nr = min_t(unsigned long, end - pfn, MEMDUMP_CHUNK_PAGES);
+		ret = memdump_send_chunk(st, pfn, nr);
+		if (unlikely(ret)) {
+			DBG("error sending chunk at pfn %#lx", pfn);
+			return ret;
+		}
+		memdump_sleep(memdump_throttle(&st->throttle, st->sent_bytes,
+					       st->job->nr_streams),
+			      &st->job->abort);
+		if (memdump_stopped(st))
+			return -EINTR;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* A page full of zeroes, checked a word at a time */
+static bool memdump_page_is_zero(struct page *page)
+{
+	void *v = kmap_atomic(page);
+	bool zero = !memchr_inv(v, 0, PAGE_SIZE);
+
+	kunmap_atomic(v);
+	return zero;
+}
+
+/*
+ * The buddy allocator only marks the first page of a free block: return the
+ * order of the block starting at @page, -1 if it isn't free. This is racy
+ * without the zone lock, which is fine for a picture of a running system.
+ */
+static int memdump_free_order(struct page *page)
+{
+	unsigned long order;
+
+	if (!PageBuddy(page))
+		return -1;
+	order = page_private(page);
+	return order < MAX_ORDER ? order : -1;
+}
+
+/*
+ * Set the bits of the pages of [start, start + nr) to send: the ones of the
+ * types of page_types, and of those in a delta dump the ones that have
+ * changed, otherwise the valid ones, and in sparse mode only if they are not
+ * zero-filled or, with skip_free, free.
+ */
+static void memdump_scan(struct memdump_stream *st, unsigned long start,
+			 unsigned long nr, unsigned long *map)
+{
+	const bool types = memdump_page_types != MEMDUMP_ALL_PAGE_TYPES;
+	unsigned long i, free_end = 0;
+	struct page *page;
+	bool changed;
+	int order;
+
+	for (i = 0; i < nr; i++) {
+		cond_resched();
+		page = pfn_valid(start + i) ? pfn_to_page(start + i) : NULL;
+		/* Free blocks are only marked on their first page */
+		if (page && (types || (sparse && skip_free)) &&
+				i >= free_end) {
+			order = memdump_free_order(page);
+			if (order >= 0)
+				free_end = i + (1UL << order);
+		}
+		if (page && types && !(memdump_page_types &
+				(1U << memdump_page_type(page, i < free_end))))
+			continue;
+		if (memdump_fp) {
+			changed = memdump_fp_update(start + i, page,
+						    !st->job->partial);
+			if (st->job->flags & MEMDUMP_F_DELTA) {
+				if (changed && page)
+					__set_bit_le(i, map);
+				continue;
+			}
+		}
+		if (!page)
+			continue;
+		if (sparse) {
+			if ((skip_free && i < free_end) ||
+					memdump_page_is_zero(page))
+				continue;
+		}
+		__set_bit_le(i, map);
+	}
+}
+
+static int dump_span_bitmap(struct memdump_stream *st, unsigned long start,
+			    unsigned long nr)
+{
+	struct memdump_chunk chunk = {
+		.type		= MEMDUMP_CHUNK_BITMAP,
+		.pfn		= start,
+		.nr_pages	= nr,
+		.size		= DIV_ROUND_UP(nr, BITS_PER_BYTE),
+	};
+	unsigned long first, last, sent = 0;
+	int ret;
+
+	memset(st->map, 0, BITS_TO_LONGS(nr) * sizeof(long));
+	memdump_scan(st, start, nr, st->map);
+	ret = memdump_send_frame(st, &chunk, st->map);
+	for (first = find_next_bit_le(st->map, nr, 0); !ret && first < nr;
+			first = find_next_bit_le(st->map, nr, last)) {
+		last = find_next_zero_bit_le(st->map, nr, first);
+		ret = memdump_send_pages(st, start + first, start + last);
+		sent += last - first;
+	}
+	st->skipped += nr - sent;
+
+	return ret;
+}
+
+static int memdump_worker(void *data)
+{
+	struct memdump_stream *st = data;
+	struct memdump_job *job = st->job;
+	unsigned long pfn, nr;
+	int ret;
+
+	set_user_nice(current, nice);
+	ret = memdump_send_header(st);
+	while (!ret && memdump_next_span(job, &pfn, &nr)) {
+		if (job->flags & MEMDUMP_F_SPARSE)
+			ret = dump_span_bitmap(st, pfn, nr);
+		else
+			ret = memdump_send_pages(st, pfn, pfn + nr);
+	}
+	if (!ret)
+		ret = memdump_send_end(st);
+
+	spin_lock(&job->lock);
+	job->raw_bytes += st->raw_bytes;
+	job->sent_bytes += st->sent_bytes;
+	job->skipped += st->skipped;
+	if (ret && !job->error) {
+		/* The spans of this stream are lost, the dump is incomplete */
+		job->error = ret;
+		job->abort = true;
+	}
+	spin_unlock(&job->lock);
+	if (atomic_dec_and_test(&job->active))
+		wake_up(&job->wait);
+
+	return ret;
+}
+
+/*
+ * Run a worker for each stream, the i-th one bound to the i-th online CPU of
+ * cpus= (wrapping around, any online CPU if none of them is), and wait for
+ * all of them.
+ */
+static int dump_memory_framed(struct memdump_stream *st, unsigned int nr,
+			      const struct memdump_request *req,
+			      const struct memdump_range *want)
+{
+	struct memdump_job job;
+	ktime_t start = ktime_get();
+	unsigned int i;
+	int cpu = -1, ret;
+
+	ret = memdump_job_init(&job, nr, want, req ? req->nr_ranges : 0);
+	if (unlikely(ret))
+		return ret;
+	get_online_cpus();
+	for (i = 0; i < nr; i++) {
+		cpu = cpumask_next_and(cpu, memdump_cpus, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first_and(memdump_cpus, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		st[i].job = &job;
+		st[i].index = i;
+		ret = memdump_stream_init(&st[i], cpu_to_node(cpu));
+		if (unlikely(ret))
+			break;
+		st[i].task = kthread_create_on_node(memdump_worker, &st[i],
+					cpu_to_node(cpu), "kmem_dumper/%u", i);
+		if (IS_ERR(st[i].task)) {
+			ret = PTR_ERR(st[i].task);
+			st[i].task = NULL;
 			break;
 		}
+		kthread_bind(st[i].task, cpu);
+	}
+	put_online_cpus();
+	if (unlikely(ret)) {
+		/* Nothing has been started yet */
+		for (i = 0; i < nr; i++) {
+			if (st[i].task)
+				kthread_stop(st[i].task);
+			memdump_stream_free(&st[i]);
+		}
+		kfree(job.ranges);
+		return ret;
+	}
+
+	memdump_fp_begin(&job, req ? req->baseline : delta_base);
+	atomic_set(&job.active, nr);
+	for (i = 0; i < nr; i++) {
+		get_task_struct(st[i].task);
+		wake_up_process(st[i].task);
+	}
+	if (wait_event_interruptible(job.wait, !atomic_read(&job.active))) {
+		/* Unblock the workers that are sending */
+		job.abort = true;
+		for (i = 0; i < nr; i++)
+			if (st[i].sock)
+				kernel_sock_shutdown(st[i].sock, SHUT_RDWR);
+		wait_event(job.wait, !atomic_read(&job.active));
+	}
+	for (i = 0; i < nr; i++) {
+		/* Wait for the worker to leave the module code */
+		kthread_stop(st[i].task);
+		put_task_struct(st[i].task);
+		memdump_stream_free(&st[i]);
 	}
-	set_fs(fs);
+
+	ret = job.error;
+	memdump_fp_end(&job, ret);
+	if (!ret)
+		DBG("dump %u (baseline %u): %llu bytes as %llu (%llu%%), "
+			"%lu pages skipped, in %lld ms, %s, %u streams",
+			job.id, job.baseline, job.raw_bytes, job.sent_bytes,
+			job.raw_bytes ?
+			div64_u64(job.sent_bytes * 100, job.raw_bytes) : 0,
+			job.skipped, ktime_to_ms(ktime_sub(ktime_get(), start)),
+			compress, nr);
+	kfree(job.ranges);
 
 	return ret;
 }
 
-static int tcp_main_loop(void)
+static int dump_memory_range_tcp(struct socket *sock, struct resource *res,
+				 struct memdump_throttle *t, u64 *bytes)
+{
+	resource_size_t i;
+	size_t len;
+	int ret;
+
+	for (i = res->start; i <= res->end; i += PAGE_SIZE) {
+		len = min_t(size_t, PAGE_SIZE, (size_t) (res->end - i + 1));
+		/* Push the last page of the range, even when it's a full one */
+		ret = memdump_send_page(sock, pfn_to_page(i >> PAGE_SHIFT),
+					len, res->end - i < PAGE_SIZE ?
+					0 : MSG_MORE);
+		if (unlikely(ret)) {
+			DBG("error sending page");
+			return ret;
+		}
+		*bytes += len;
+		/* Every chunk's worth of pages, like the framed streams */
+		if (!((i >> PAGE_SHIFT) % MEMDUMP_CHUNK_PAGES))
+			memdump_sleep(memdump_throttle(t, *bytes, 1), NULL);
+		cond_resched();
+	}
+	return 0;
+}
+
+static int dump_memory_raw(struct socket *sock)
 {
+	struct memdump_throttle throttle = { };
 	struct resource *p;
-	int ret = 0;
+	ktime_t start = ktime_get();
+	u64 bytes = 0;
+	int ret;
 
-	ret = client->ops->accept(server, client, 0);
-	if (ret < 0)
-		goto out;
 	for (p = iomem_resource.child; p ; p = p->sibling) {
-		if (strncmp(p->name, SYSTEM_RAM_STRING,
-				sizeof(SYSTEM_RAM_STRING)))
+		if (!memdump_is_ram(p))
 			continue;
-		ret = dump_memory_range_tcp(p);
-		if (unlikely(ret)) {
-			DBG("write error");
+		ret = dump_memory_range_tcp(sock, p, &throttle, &bytes);
+		if (unlikely(ret))
+			return ret;
+	}
+	DBG("dumped %llu bytes in %lld ms, raw", bytes,
+		ktime_to_ms(ktime_sub(ktime_get(), start)));
+	return 0;
+}
+
+static int memdump_recv(struct socket *sock, void *buf, size_t len)
+{
+	struct msghdr msg = { };
+	struct kvec vec = { .iov_base = buf, .iov_len = len };
+	int ret;
+
+	ret = kernel_recvmsg(sock, &msg, &vec, 1, len, MSG_WAITALL);
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -ECONNRESET;
+}
+
+/*
+ * With requests=1 every connection starts with a struct memdump_request,
+ * see memdump.h. The ranges are returned in *want (NULL for all the RAM),
+ * to be freed by the caller.
+ */
+static int memdump_recv_request(struct socket *sock,
+				struct memdump_request *req,
+				struct memdump_range **want)
+{
+	size_t len;
+	int ret;
+
+	*want = NULL;
+	sock->sk->sk_rcvtimeo = MEMDUMP_REQUEST_TIMEOUT;
+	ret = memdump_recv(sock, req, sizeof(*req));
+	if (ret)
+		return ret;
+	if (req->magic != MEMDUMP_REQUEST_MAGIC ||
+			req->version != MEMDUMP_VERSION ||
+			req->nr_ranges > MEMDUMP_MAX_REQUEST_RANGES)
+		return -EPROTO;
+	if (!req->nr_ranges)
+		return 0;
+	len = req->nr_ranges * sizeof(**want);
+	*want = kmalloc(len, GFP_KERNEL);
+	if (!*want)
+		return -ENOMEM;
+	ret = memdump_recv(sock, *want, len);
+	if (ret) {
+		kfree(*want);
+		*want = NULL;
+		return ret;
+	}
+	req->nr_ranges = memdump_sort_ranges(*want, req->nr_ranges);
+	if (!req->nr_ranges) {
+		/* Only empty ranges: don't turn it into a dump of all the RAM */
+		kfree(*want);
+		*want = NULL;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * All the connections of a dump must send the same request, the one of the
+ * first connection is kept.
+ */
+static int memdump_recv_requests(struct memdump_stream *st, unsigned int nr,
+				 struct memdump_request *req,
+				 struct memdump_range **want)
+{
+	struct memdump_request other;
+	struct memdump_range *ranges;
+	unsigned int i;
+	int ret;
+
+	ret = memdump_recv_request(st[0].sock, req, want);
+	for (i = 1; !ret && i < nr; i++) {
+		ret = memdump_recv_request(st[i].sock, &other, &ranges);
+		if (ret)
+			break;
+		if (memcmp(req, &other, sizeof(other)) ||
+				(req->nr_ranges && memcmp(*want, ranges,
+				req->nr_ranges * sizeof(*ranges))))
+			ret = -EINVAL;
+		kfree(ranges);
+	}
+	if (ret) {
+		DBG("bad request (%d)", ret);
+		kfree(*want);
+		*want = NULL;
+	}
+	return ret;
+}
+
+/* Accept the connections of a dump, all of them before starting */
+static int tcp_main_loop(void)
+{
+	struct memdump_request req;
+	struct memdump_range *want = NULL;
+	struct memdump_stream *st;
+	unsigned int i, nr = framed ? streams : 1;
+	int ret = 0;
+
+	st = kcalloc(nr, sizeof(*st), GFP_KERNEL);
+	if (unlikely(!st))
+		return -ENOMEM;
+	for (i = 0; i < nr; i++) {
+		ret = kernel_accept(server, &st[i].sock, 0);
+		if (ret < 0)
 			goto out;
-		}
 	}
+	memdump_wake_lock_start();
+	if (requests) {
+		ret = memdump_recv_requests(st, nr, &req, &want);
+		if (ret)
+			goto out_unlock;
+	}
+	if (framed)
+		ret = dump_memory_framed(st, nr, requests ? &req : NULL, want);
+	else
+		ret = dump_memory_raw(st[0].sock);
+	if (unlikely(ret))
+		DBG("write error");
+out_unlock:
+	memdump_wake_lock_stop();
 out:
-	client->ops->shutdown(client, 0);
-	client->ops->release(client);
+	for (i = 0; i < nr && st[i].sock; i++) {
+		kernel_sock_shutdown(st[i].sock, SHUT_RDWR);
+		sock_release(st[i].sock);
+	}
+	kfree(want);
+	kfree(st);
+
+	return ret;
+}
+
+/*
+ * path=: a single dump, in the framed format, as soon as the module is
+ * loaded. Block devices are written through their page cache like files,
+ * the dump is on the storage when this returns.
+ */
+static int dump_memory_file(void)
+{
+	struct memdump_stream st = { };
+	int ret;
+
+	st.file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+			    0600);
+	if (IS_ERR(st.file)) {
+		DBG("error opening %s", path);
+		return PTR_ERR(st.file);
+	}
+	memdump_wake_lock_start();
+	ret = dump_memory_framed(&st, 1, NULL, NULL);
+	if (!ret)
+		ret = vfs_fsync(st.file, 0);
+	memdump_wake_lock_stop();
+	if (unlikely(ret))
+		DBG("error writing %s (%d)", path, ret);
+	filp_close(st.file, NULL);
 
 	return ret;
 }
@@ -164,7 +1429,20 @@ static int memory_dumper(void *dummy)
 {
 	int ret;
 
-	set_user_nice(current, 0);
+	set_user_nice(current, nice);
+	if (set_cpus_allowed_ptr(current, memdump_cpus))
+		DBG("none of the CPUs %s is online", cpus);
+	if (path) {
+		dump_memory_file();
+		/* Nothing else to do until the module is removed */
+		set_current_state(TASK_INTERRUPTIBLE);
+		while (!kthread_should_stop()) {
+			schedule();
+			set_current_state(TASK_INTERRUPTIBLE);
+		}
+		__set_current_state(TASK_RUNNING);
+		return 0;
+	}
 	set_current_state(TASK_INTERRUPTIBLE);
 
 	ret = setup_tcp();
@@ -182,16 +1460,84 @@ static int memory_dumper(void *dummy)
 
 static int __init memdump_init(void)
 {
-	memdump_wake_lock_start();
+	int ret;
+
+	if (!strcmp(compress, "lzo")) {
+		memdump_flags |= MEMDUMP_F_LZO;
+	} else if (strcmp(compress, "none")) {
+		printk(KERN_ERR "memdump: unknown compression %s\n", compress);
+		return -EINVAL;
+	}
+	if (sparse)
+		memdump_flags |= MEMDUMP_F_SPARSE;
+	if (checksum || requests)
+		memdump_flags |= MEMDUMP_F_CRC;
+	if ((page_types && memdump_parse_page_types()) ||
+			(pfns && memdump_parse_pfns())) {
+		printk(KERN_ERR "memdump: bad page_types or pfns\n");
+		return -EINVAL;
+	}
+	/*
+	 * The bitmaps also keep the pages without a struct page of resources
+	 * other than the RAM out of the dump.
+	 */
+	if (page_types || pfns || strcmp(resources, SYSTEM_RAM_STRING))
+		memdump_flags |= MEMDUMP_F_SPARSE | MEMDUMP_F_FILTERED;
+	if (sndbuf < 0)
+		return -EINVAL;
+	if (streams < 1 || streams > MEMDUMP_MAX_STREAMS) {
+		printk(KERN_ERR "memdump: streams must be in [1, %d]\n",
+				MEMDUMP_MAX_STREAMS);
+		return -EINVAL;
+	}
+	if (nice < -20 || nice > 19)
+		return -EINVAL;
+	if (path && (streams > 1 || requests)) {
+		printk(KERN_ERR "memdump: path can't be used with streams "
+				"or requests\n");
+		return -EINVAL;
+	}
+	if (!alloc_cpumask_var(&memdump_cpus, GFP_KERNEL))
+		return -ENOMEM;
+	cpumask_setall(memdump_cpus);
+	if (cpus && cpulist_parse(cpus, memdump_cpus)) {
+		printk(KERN_ERR "memdump: bad CPU list %s\n", cpus);
+		ret = -EINVAL;
+		goto out_free;
+	}
+	if (delta) {
+		ret = memdump_fp_init();
+		if (ret)
+			goto out_free;
+	}
+	/*
+	 * Parallel streams can only be merged back with the framing, and a
+	 * file needs the header to tell where its pages belong.
+	 */
+	framed = memdump_flags || streams > 1 || delta || path;
+	wake_lock_init(&memdump_wake_lock, WAKE_LOCK_SUSPEND,
+		       "memdump_wake_lock");
 	memory_dumper_task = kthread_run(memory_dumper, NULL, "kmem_dumper");
-	return memory_dumper_task ? 0 : -ENOMEM;
+	if (IS_ERR(memory_dumper_task)) {
+		wake_lock_destroy(&memdump_wake_lock);
+		vfree(memdump_fp);
+		ret = PTR_ERR(memory_dumper_task);
+		goto out_free;
+	}
+	return 0;
+
+out_free:
+	free_cpumask_var(memdump_cpus);
+	return ret;
 }
 
 static void __exit memdump_exit(void)
 {
-	memdump_wake_lock_stop();
 	force_sig(SIGKILL, memory_dumper_task);
 	kthread_stop(memory_dumper_task);
+	wake_lock_destroy(&memdump_wake_lock);
+	vfree(memdump_fp);
+	free_cpumask_var(memdump_cpus);
 }
 
 module_init(memdump_init);
@@ -0,0 +1,143 @@
+/*
+ * memdump: wire format of the framed memory dump stream
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Copyright (C) 2015 Andrea Righi <righi.andrea@gmail.com>
+ */
+
+#ifndef MEMDUMP_H
+#define MEMDUMP_H
+
+#include <linux/types.h>
+
+/*
+ * Without any option the module sends the "System RAM" ranges back to back,
+ * with no header at all (raw mode). The framed mode (any of compress=lzo,
+ * sparse=1, streams > 1, delta=1, requests=1, checksum=1, or a dump to a
+ * local file with path=) starts with:
+ *
+ *	struct memdump_header
+ *	struct memdump_range	x nr_ranges
+ *
+ * followed by the pages of the ranges as a sequence of chunks of consecutive
+ * pages:
+ *
+ *	struct memdump_chunk
+ *	payload			(size bytes)
+ *
+ * and terminated by a MEMDUMP_CHUNK_END chunk: a stream without it has been
+ * truncated. All the fields are in the byte order of the dumped machine.
+ *
+ * With MEMDUMP_F_SPARSE the ranges are split in spans, each introduced by a
+ * MEMDUMP_CHUNK_BITMAP chunk, and only the pages whose bit is set follow:
+ * the others are zero-filled, free or not backed by memory, and read as
+ * zeroes.
+ *
+ * With MEMDUMP_F_FILTERED (resources=, pfns= or page_types=) the ranges are
+ * only the selected parts of the memory, and the pages that are left out of
+ * a span, whatever their content, are cleared in its bitmap too.
+ *
+ * With MEMDUMP_F_DELTA the bitmaps list the pages that have changed since
+ * the dump with id baseline: the others are the same as in that dump.
+ *
+ * A dump can be sent over several connections (streams=N): each one carries
+ * the header, with its index, and a share of the spans, in no particular
+ * order. The dump is complete when all the streams have reached their end
+ * chunk.
+ *
+ * With requests=1 the client starts every connection with:
+ *
+ *	struct memdump_request
+ *	struct memdump_range	x nr_ranges
+ *
+ * to get only the given ranges (all the RAM with nr_ranges 0), clipped to the
+ * "System RAM" ones and listed as such in the header. A request made only of
+ * empty ranges is refused (the connection is closed). A dump that has been
+ * interrupted is resumed by requesting the ranges that are still missing.
+ * All the connections of a multi-stream dump must send the same request.
+ *
+ * With MEMDUMP_F_CRC (checksum=1, implied by requests=1) the crc field of the
+ * chunks with a payload is the CRC-32 of the payload as it is sent, the one
+ * of zlib and gzip.
+ */
+#define MEMDUMP_MAGIC		0x504d444d	/* "MDMP" */
+#define MEMDUMP_VERSION		4
+
+/* Header flags */
+#define MEMDUMP_F_LZO		(1 << 0)	/* chunks may be compressed */
+#define MEMDUMP_F_SPARSE	(1 << 1)	/* spans with a bitmap */
+#define MEMDUMP_F_DELTA		(1 << 2)	/* only the pages changed */
+#define MEMDUMP_F_CRC		(1 << 3)	/* chunks are checksummed */
+#define MEMDUMP_F_FILTERED	(1 << 4)	/* only some of the RAM */
+
+struct memdump_header {
+	__u32 magic;
+	__u16 version;
+	__u16 flags;
+	__u32 page_size;
+	__u32 nr_ranges;
+	__u16 stream;		/* index of this stream */
+	__u16 nr_streams;	/* streams of the dump */
+	__u32 id;		/* of this dump, 0 without delta=1 */
+	__u32 baseline;		/* MEMDUMP_F_DELTA: id of the previous dump */
+};
+
+/* A range of RAM (of resources=), or a requested one, in pages */
+struct memdump_range {
+	__u64 start_pfn;
+	__u64 nr_pages;
+};
+
+#define MEMDUMP_CHUNK_MAGIC	0x4b4e4843	/* "CHNK" */
+
+/* Chunk types */
+enum {
+	MEMDUMP_CHUNK_RAW,	/* nr_pages pages, as they are */
+	MEMDUMP_CHUNK_LZO,	/* nr_pages pages, LZO1X compressed */
+	MEMDUMP_CHUNK_END,	/* end of the dump, no payload */
+	/*
+	 * Pages of the span [pfn, pfn + nr_pages) that are sent, bit n (bit
+	 * n % 8 of byte n / 8) for page pfn + n
+	 */
+	MEMDUMP_CHUNK_BITMAP,
+};
+
+/* Pages per chunk: the unit of compression */
+#define MEMDUMP_CHUNK_PAGES	16
+
+struct memdump_chunk {
+	__u32 magic;
+	__u16 type;
+	__u16 flags;
+	__u64 pfn;		/* first page of the chunk */
+	__u32 nr_pages;
+	__u32 size;		/* bytes of payload that follow */
+	__u32 crc;		/* MEMDUMP_F_CRC: of the payload */
+	__u32 reserved;
+};
+
+#define MEMDUMP_REQUEST_MAGIC	0x5145524d	/* "MREQ" */
+
+struct memdump_request {
+	__u32 magic;
+	__u16 version;		/* MEMDUMP_VERSION */
+	__u16 flags;		/* none yet, 0 */
+	__u32 nr_ranges;	/* that follow, 0 for all the RAM */
+	__u32 baseline;		/* delta=1: id of the dump to compare with */
+};
+
+#endif /* MEMDUMP_H */